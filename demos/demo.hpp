@@ -5,7 +5,9 @@
 #ifndef DEMO_HPP_
 #define DEMO_HPP_
 
+#include <mutex>
 #include <string>
+#include <UsefulUtils/logging.hpp>
 #include <VulkanWrappers/logical_device.hpp>
 #include <VulkanWrappers/swap_chain.hpp>
 #include <Windowing/platform.hpp>
@@ -23,14 +25,41 @@ public:
 
     virtual std::string name() = 0;
 
+    // Extra line of statistics shown under the sample count. Empty if the
+    // demo has nothing to report.
+    virtual std::string statusText() { return ""; }
+
     uint32_t sample() const { return sample_; }
 
+    // Number of samples per pixel traced by each renderFrame() call. Tracing
+    // several at once amortizes the fixed per frame cost of recording,
+    // submitting and presenting.
+    uint32_t samples_per_frame() const { return samples_per_frame_; }
+    void set_samples_per_frame(uint32_t samples_per_frame) {
+        CXL_DCHECK(samples_per_frame > 0);
+        samples_per_frame_ = samples_per_frame;
+    }
+
+    // Whether the device has VK_KHR_ray_query enabled, which lets compute
+    // shaders trace rays against acceleration structures. Set by the harness
+    // before the first setup().
+    bool ray_query_supported() const { return ray_query_supported_; }
+    void set_ray_query_supported(bool supported) { ray_query_supported_ = supported; }
+
+    // Lock the harness holds while it renders a frame and presents it. Demos
+    // that submit from a thread of their own take it around each submission,
+    // since the graphics and compute queues may be the same VkQueue.
+    void set_queue_mutex(std::mutex* queue_mutex) { queue_mutex_ = queue_mutex; }
+
     virtual void processEvent(display::InputEvent event) = 0;
 
 protected:
     gfx::LogicalDeviceWeakPtr logical_device_;
     uint32_t width_, height_, num_swap_images_;
     uint32_t sample_ = 1;
+    uint32_t samples_per_frame_ = 1;
+    bool ray_query_supported_ = false;
+    std::mutex* queue_mutex_ = nullptr;
 };
 
 #endif // DEMO_HPP_
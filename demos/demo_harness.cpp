@@ -4,6 +4,7 @@
 
 
 #include "demo_harness.hpp"
+#include <cstring>
 #include <iostream>
 
 #include <UsefulUtils/logging.hpp>
@@ -17,6 +18,25 @@ namespace {
 uint32_t index = 0;
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Upper bound on the samples per pixel a demo traces in a single frame.
+const uint32_t kMaxSamplesPerFrame = 64;
+
+bool supportsRayQuery(const vk::PhysicalDevice& physical_device) {
+    bool has_extension = false;
+    for (const auto& extension : physical_device.enumerateDeviceExtensionProperties()) {
+        if (std::strcmp(extension.extensionName, VK_KHR_RAY_QUERY_EXTENSION_NAME) == 0) {
+            has_extension = true;
+            break;
+        }
+    }
+    if (!has_extension) {
+        return false;
+    }
+    auto features = physical_device.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                                 vk::PhysicalDeviceRayQueryFeaturesKHR>();
+    return features.get<vk::PhysicalDeviceRayQueryFeaturesKHR>().rayQuery;
+}
+
 } // anonymous namespace
 
 
@@ -42,16 +62,31 @@ void DemoHarness::initialize(PlatformNativeWindowHandle window, std::vector<cons
                 gfx::PhysicalDevice::kSwapchainExtensions.begin(), 
                 gfx::PhysicalDevice::kSwapchainExtensions.end());
 
-
     physical_device_ = instance_->pickBestDevice(surface_, device_extensions);
     CXL_DCHECK(physical_device_);
 
+    // Ray queries let compute shaders trace rays against acceleration
+    // structures. Only some optional features of the demos use them, so
+    // they are enabled when the device has them and skipped otherwise.
+    const bool ray_query_supported = supportsRayQuery(physical_device_->vk());
+    vk::PhysicalDeviceRayQueryFeaturesKHR ray_query_features;
+    ray_query_features.rayQuery = VK_TRUE;
+    if (ray_query_supported) {
+        device_extensions.push_back(VK_KHR_RAY_QUERY_EXTENSION_NAME);
+    }
+    CXL_LOG(INFO) << "DemoHarness ray queries: " << (ray_query_supported ? "supported" : "unsupported");
 
     // Make a logical device from the physical device.
     logical_device_ =
-        std::make_shared<gfx::LogicalDevice>(physical_device_, surface_, device_extensions);
+        std::make_shared<gfx::LogicalDevice>(physical_device_, surface_, device_extensions,
+                                             /*features_next*/ray_query_supported ? &ray_query_features : nullptr);
     CXL_DCHECK(logical_device_);
 
+    for (auto& demo : demos_) {
+        demo->set_ray_query_supported(ray_query_supported);
+        demo->set_queue_mutex(&queue_mutex_);
+    }
+
 
     text_renderer_ = std::make_shared<TextRenderer>(logical_device_);
 
@@ -72,6 +107,9 @@ void DemoHarness::render() {
     while (should_render_) {
         CXL_DCHECK(current_demo_);
 
+        // Input handling may rebuild resources and beginFrame() both submits
+        // and presents, so keep other threads off the queues until it returns.
+        std::lock_guard<std::mutex> lock(queue_mutex_);
         processInputEvents();
         swap_chain_->beginFrame([&](vk::Semaphore& image_available_semaphore, vk::Fence& in_flight_fence, uint32_t image_index,
                                     uint32_t frame) -> std::vector<vk::Semaphore> {
@@ -91,8 +129,13 @@ void DemoHarness::render() {
             command_buffer->draw(3);
 
             // Render Debug Text.
-            std::string text = "sample: " + std::to_string(current_demo_->sample());
+            std::string text = "sample: " + std::to_string(current_demo_->sample()) +
+                               " (" + std::to_string(current_demo_->samples_per_frame()) + " spp/frame)";
             text_renderer_->renderText(command_buffer, text, {-0.9, 0.8}, {-0.5, 0.9}, text.size());
+            std::string status = current_demo_->statusText();
+            if (!status.empty()) {
+                text_renderer_->renderText(command_buffer, status, {-0.9, 0.7}, {-0.5, 0.8}, status.size());
+            }
 
             command_buffer->endRenderPass();
             command_buffer->endRecording();
@@ -131,6 +174,16 @@ void DemoHarness::processInputEvents() {
             index %= demos_.size();
             current_demo_ = demos_[index];
             platform_->set_title(current_demo_->name());
+        } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::N) {
+            // Cycle through 1, 2, 4, ... kMaxSamplesPerFrame samples per frame.
+            uint32_t samples_per_frame = current_demo_->samples_per_frame() * 2;
+            if (samples_per_frame > kMaxSamplesPerFrame) {
+                samples_per_frame = 1;
+            }
+            for (auto demo : demos_) {
+                demo->set_samples_per_frame(samples_per_frame);
+            }
+            CXL_LOG(INFO) << "Samples per frame: " << samples_per_frame;
         } else {
             current_demo_->processEvent(event);
         }
@@ -17,6 +17,7 @@
 
 #include <thread>
 #include <atomic>
+#include <mutex>
 
 class DemoHarness {
 public:
@@ -73,6 +74,10 @@ private:
     std::thread render_thread_;
     std::atomic<bool> should_render_ = false;
 
+    // Held by the render thread for a whole frame, from input handling to
+    // present, and shared with the demos' background submissions.
+    std::mutex queue_mutex_;
+
     // Text renderer
     std::shared_ptr<TextRenderer> text_renderer_;
 };
@@ -4,12 +4,42 @@
 
 
 #include "naive_path_tracer.hpp"
+#include <bit>
+#include <chrono>
+#include <cmath>
 
 namespace {
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 const int MAX_BOUNCES = 8;
 
+// Vulkan has no portable query for the number of compute units on a device,
+// so the persistent grid is a fixed number of workgroups that is enough to
+// fill current desktop GPUs. Since pixels are pulled from an atomic queue,
+// any workgroups beyond what the device can keep resident simply find the
+// queue empty and exit.
+const uint32_t kMegakernelWorkgroups = 1024;
+
+// Meshes with fewer triangles than this are intersected with the cooperative
+// kernel that stages triangles through shared memory.
+const uint32_t kTiledIntersectionMaxTriangles = 4096;
+
+// Static meshes with at least this many triangles get a BVH. Below it,
+// brute force testing every triangle is cheap enough.
+const uint32_t kBVHMinTriangles = 16384;
+
+// Images with more pixels than this are rendered in tiles of kTileSize by
+// kTileSize pixels. Below it the full resolution buffers are small enough
+// that tracing the whole image in one go is the faster option.
+const uint32_t kMaxUntiledPixels = 3840 * 2160;
+const uint32_t kTileSize = 256;
+
+// Passes averaged over by the intersection benchmark.
+const uint32_t kBenchmarkRepetitions = 16;
+
+// Workgroup size of image_error.comp, each of which writes one partial sum.
+const uint32_t kErrorWorkgroupSize = 256;
+
 } // anonymous namespace
 
 NaivePathTracer::~NaivePathTracer() {
@@ -24,108 +54,114 @@ NaivePathTracer::~NaivePathTracer() {
 
     render_pass_.reset();
     resolve_texture_.reset();
+    tile_resolve_textures_.clear();
+    tile_accum_texture_.reset();
+    reference_texture_.reset();
+    squared_errors_.clear();
+
+    for (auto& buffers : frame_buffers_) {
+        releaseWavefrontBuffers(&buffers);
+    }
+    for (auto& buffers : tile_buffers_) {
+        releaseWavefrontBuffers(&buffers);
+    }
+    for (auto& work_queue : work_queues_) {
+        host_buffer_pool_->release(std::move(work_queue));
+    }
+    device_buffer_pool_->reclaim();
+    host_buffer_pool_->reclaim();
 }
 
 void NaivePathTracer::setup(gfx::LogicalDevicePtr logical_device, int32_t num_swap, int32_t width, int32_t height) {
-    num_swap_images_ = num_swap;
+    // The harness calls setup() again every time the swapchain is recreated.
+    // Shaders and scene geometry don't depend on the swapchain, so only the
+    // resolution dependent state needs to be rebuilt.
+    const bool initialized = logical_device_.lock() == logical_device;
     logical_device_ = logical_device;
 
-    compute_command_buffers_ = gfx::CommandBuffer::create(logical_device, gfx::Queue::Type::kCompute,
-                                                          vk::CommandBufferLevel::ePrimary, num_swap);
-    CXL_DCHECK(compute_command_buffers_.size() == num_swap);
+    if (!initialized || num_swap_images_ != num_swap) {
+        compute_command_buffers_ = gfx::CommandBuffer::create(logical_device, gfx::Queue::Type::kCompute,
+                                                              vk::CommandBufferLevel::ePrimary, num_swap);
+        CXL_DCHECK(compute_command_buffers_.size() == num_swap);
+    }
+    num_swap_images_ = num_swap;
+
+    if (initialized) {
+        resize(width, height);
+        return;
+    }
+
+    device_buffer_pool_ = std::make_unique<christalz::BufferPool>(logical_device,
+                                                                  christalz::BufferPool::Memory::kDeviceLocal);
+    host_buffer_pool_ = std::make_unique<christalz::BufferPool>(logical_device,
+                                                                christalz::BufferPool::Memory::kHostVisible);
+
     compute_semaphores_ = logical_device->createSemaphores(MAX_FRAMES_IN_FLIGHT);
 
     cxl::FileSystem fs(cxl::FileSystem::currentExecutablePath() + "/resources/spirv");
-    mwc64x_seeder_ = christalz::ShaderResource::createCompute(logical_device, fs, "mwc64x_seeding");
-    CXL_DCHECK(mwc64x_seeder_);
- 
     ray_generator_ = christalz::ShaderResource::createCompute(logical_device, fs, "pinhole_camera");
     CXL_DCHECK(ray_generator_);
 
     hit_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "intersect");
     CXL_DCHECK(hit_tester_);
 
+    indexed_hit_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "intersect_indexed");
+    CXL_DCHECK(indexed_hit_tester_);
+
+    tiled_hit_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "intersect_tiled");
+    CXL_DCHECK(tiled_hit_tester_);
+
+    bvh_hit_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "intersect_bvh");
+    CXL_DCHECK(bvh_hit_tester_);
+
+    if (ray_query_supported_) {
+        ray_query_hit_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "intersect_ray_query");
+        CXL_DCHECK(ray_query_hit_tester_);
+    }
+
+    lbvh_builder_ = christalz::LBVHBuilder::create(logical_device, fs);
+    CXL_DCHECK(lbvh_builder_);
+
     bouncer_ = christalz::ShaderResource::createCompute(logical_device, fs, "bounce");
     CXL_DCHECK(bouncer_);
 
-    lighter_ = christalz::ShaderResource::createGraphics(logical_device, fs, "ray");
-    CXL_DCHECK(lighter_);
+    shadow_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "shadow");
+    CXL_DCHECK(shadow_tester_);
 
-    resolve_ = christalz::ShaderResource::createGraphics(logical_device, fs, "resolve");
-    CXL_DCHECK(resolve_);
+    bvh_shadow_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "shadow_bvh");
+    CXL_DCHECK(bvh_shadow_tester_);
 
-    resize(width, height);
-}
+    if (ray_query_supported_) {
+        ray_query_shadow_tester_ = christalz::ShaderResource::createCompute(logical_device, fs, "shadow_ray_query");
+        CXL_DCHECK(ray_query_shadow_tester_);
+    }
 
-void NaivePathTracer::resize(uint32_t width, uint32_t height) {
-    CXL_DCHECK(width > 0 && height > 0);
-    auto logical_device = logical_device_.lock();
-    width_ = width;
-    height_ = height;
+    shadow_resolver_ = christalz::ShaderResource::createCompute(logical_device, fs, "shadow_resolve");
+    CXL_DCHECK(shadow_resolver_);
 
-    resolve_texture_.reset();
-    accum_texture_.reset();
+    megakernel_ = christalz::ShaderResource::createCompute(logical_device, fs, "megakernel");
+    CXL_DCHECK(megakernel_);
 
-    accum_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, 
-                                                                    (vk::ImageUsageFlagBits::eColorAttachment | 
-                                                                    vk::ImageUsageFlagBits::eSampled |
-                                                                    vk::ImageUsageFlagBits::eInputAttachment));
-    CXL_DCHECK(accum_texture_);
-    
-    resolve_texture_ = gfx::ImageUtils::createColorAttachment(logical_device, width,
-                                                              height, vk::SampleCountFlagBits::e1);
-    CXL_DCHECK(resolve_texture_);
-
-
-    gfx::RenderPassBuilder builder(logical_device);
-    builder.addColorAttachment(accum_texture_, {
-            .load_op = vk::AttachmentLoadOp::eLoad,
-            .store_op = vk::AttachmentStoreOp::eStore,
-    });
-    builder.addColorAttachment(resolve_texture_);
-
-    builder.addSubpass({.bind_point = vk::PipelineBindPoint::eGraphics,
-                            .input_indices = {},
-                            .color_indices = {0}});
-    builder.addSubpass({.bind_point = vk::PipelineBindPoint::eGraphics,
-                            .input_indices = {0},
-                            .color_indices = {1}});
-    render_pass_ = std::move(builder.build());
-
-    std::vector<HitPoint> hits;
-    hits.resize(width_ * height_);
-    for (uint32_t i = 0; i < num_swap_images_; i++) {
-        rays_.push_back(gfx::ComputeBuffer::createStorageBuffer(logical_device, sizeof(Ray) * width_ * height_));
-        random_seeds_.push_back(gfx::ComputeBuffer::createStorageBuffer(logical_device, sizeof(uint32_t) * width_ * height_ * 2));
-        hits_.push_back(gfx::ComputeBuffer::createFromVector(logical_device, hits, vk::BufferUsageFlagBits::eStorageBuffer));
-    }
+    material_counter_ = christalz::ShaderResource::createCompute(logical_device, fs, "material_count");
+    CXL_DCHECK(material_counter_);
 
-    auto compute_buffer = compute_command_buffers_[0];
-    compute_buffer->reset();
-    compute_buffer->beginRecording();
+    material_scanner_ = christalz::ShaderResource::createCompute(logical_device, fs, "material_scan");
+    CXL_DCHECK(material_scanner_);
 
-    uint64_t offset = 0;
-    for (uint32_t i = 0; i < num_swap_images_; i++) {
-        compute_buffer->setProgram(mwc64x_seeder_->program());
-        compute_buffer->bindUniformBuffer(0, 0, random_seeds_[i]);
-        compute_buffer->pushConstants(offset);
-        compute_buffer->dispatch(width_ * height_/ 16, 1, 1);
-        offset += width_ * height_;
-    }
+    material_scatterer_ = christalz::ShaderResource::createCompute(logical_device, fs, "material_scatter");
+    CXL_DCHECK(material_scatterer_);
 
-    compute_buffer->endRecording();
-    logical_device->getQueue(gfx::Queue::Type::kCompute).submit(compute_buffer);
-    logical_device->waitIdle();
+    tile_accumulator_ = christalz::ShaderResource::createCompute(logical_device, fs, "tile_accumulate");
+    CXL_DCHECK(tile_accumulator_);
 
-    camera_ = Camera {
-        .position = glm::vec4(278, 273, -800, 1.0),
-        .direction = glm::vec4(0,0,1,0),
-        .focal_length = 0.035,
-        .width = 0.025,
-        .height = 0.025,
-        .x_res = width_,
-        .y_res = height_
-    };
+    error_meter_ = christalz::ShaderResource::createCompute(logical_device, fs, "image_error");
+    CXL_DCHECK(error_meter_);
+
+    lighter_ = christalz::ShaderResource::createGraphics(logical_device, fs, "ray");
+    CXL_DCHECK(lighter_);
+
+    resolve_ = christalz::ShaderResource::createGraphics(logical_device, fs, "resolve");
+    CXL_DCHECK(resolve_);
 
     meshes_ = {
         // Floor - White
@@ -251,6 +287,748 @@ void NaivePathTracer::resize(uint32_t width, uint32_t height) {
 
               Material(glm::vec4(0.7)))
     };
+
+    buildSceneBuffers(logical_device);
+    buildEmitters(logical_device);
+    buildMeshBVHs(logical_device);
+    if (ray_query_supported_) {
+        buildAccelerationStructure(logical_device);
+    }
+
+    resize(width, height);
+}
+
+void NaivePathTracer::resize(uint32_t width, uint32_t height) {
+    CXL_DCHECK(width > 0 && height > 0);
+    auto logical_device = logical_device_.lock();
+    width_ = width;
+    height_ = height;
+
+    tiled_ = force_tiled_ || width_ * height_ > kMaxUntiledPixels;
+
+    resolve_texture_.reset();
+    accum_texture_.reset();
+    render_pass_.reset();
+    tile_resolve_textures_.clear();
+    tile_accum_texture_.reset();
+
+    // The accumulation images below start out empty, so the average restarts.
+    sample_ = 1;
+    reference_texture_.reset();
+    squared_errors_.clear();
+    error_measurements_.clear();
+    has_reference_ = false;
+
+    // Hand the previous buffers back to the pools so that the ones that still
+    // fit can be reused below, once the last frames are done with them.
+    for (auto& buffers : frame_buffers_) {
+        releaseWavefrontBuffers(&buffers);
+    }
+    frame_buffers_.clear();
+    for (auto& buffers : tile_buffers_) {
+        releaseWavefrontBuffers(&buffers);
+    }
+    tile_buffers_.clear();
+    for (auto& work_queue : work_queues_) {
+        host_buffer_pool_->release(std::move(work_queue));
+    }
+    work_queues_.clear();
+    logical_device->waitIdle();
+    device_buffer_pool_->reclaim();
+    host_buffer_pool_->reclaim();
+
+    for (uint32_t i = 0; i < num_swap_images_; i++) {
+        work_queues_.push_back(host_buffer_pool_->acquire(sizeof(uint32_t)));
+    }
+
+    if (tiled_) {
+        tile_accum_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height,
+                                                                           vk::ImageUsageFlagBits::eStorage,
+                                                                           vk::ImageLayout::eGeneral);
+        CXL_DCHECK(tile_accum_texture_);
+
+        clear_tile_accumulation_ = true;
+
+        reference_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height,
+                                                                          vk::ImageUsageFlagBits::eStorage,
+                                                                          vk::ImageLayout::eGeneral);
+        CXL_DCHECK(reference_texture_);
+        const uint32_t num_error_workgroups = (width * height + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize;
+        for (uint32_t i = 0; i < num_swap_images_; i++) {
+            squared_errors_.push_back(gfx::ComputeBuffer::createHostAccessableBuffer(
+                logical_device, sizeof(float) * num_error_workgroups, vk::BufferUsageFlagBits::eStorageBuffer));
+        }
+        error_measurements_.assign(num_swap_images_, ErrorMeasurement());
+
+        // The graphics queue may still be sampling one frame's resolve image
+        // while the next frame's tiles are traced, so every swapchain image
+        // gets its own resolve image and tile buffers.
+        for (uint32_t i = 0; i < num_swap_images_; i++) {
+            auto resolve_texture = gfx::ImageUtils::createStorageImage(logical_device, width,
+                                                                       height, vk::SampleCountFlagBits::e1);
+            CXL_DCHECK(resolve_texture);
+            tile_resolve_textures_.push_back(resolve_texture);
+            tile_buffers_.push_back(createWavefrontBuffers(kTileSize * kTileSize));
+        }
+        CXL_LOG(INFO) << "NaivePathTracer rendering " << width_ << "x" << height_ << " in "
+                      << (width_ + kTileSize - 1) / kTileSize * ((height_ + kTileSize - 1) / kTileSize)
+                      << " tiles of " << kTileSize << "x" << kTileSize;
+    } else {
+        accum_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, 
+                                                                        (vk::ImageUsageFlagBits::eColorAttachment | 
+                                                                        vk::ImageUsageFlagBits::eSampled |
+                                                                        vk::ImageUsageFlagBits::eInputAttachment));
+        CXL_DCHECK(accum_texture_);
+        
+        resolve_texture_ = gfx::ImageUtils::createColorAttachment(logical_device, width,
+                                                                  height, vk::SampleCountFlagBits::e1);
+        CXL_DCHECK(resolve_texture_);
+
+
+        gfx::RenderPassBuilder builder(logical_device);
+        builder.addColorAttachment(accum_texture_, {
+                .load_op = vk::AttachmentLoadOp::eLoad,
+                .store_op = vk::AttachmentStoreOp::eStore,
+        });
+        builder.addColorAttachment(resolve_texture_);
+
+        builder.addSubpass({.bind_point = vk::PipelineBindPoint::eGraphics,
+                                .input_indices = {},
+                                .color_indices = {0}});
+        builder.addSubpass({.bind_point = vk::PipelineBindPoint::eGraphics,
+                                .input_indices = {0},
+                                .color_indices = {1}});
+        render_pass_ = std::move(builder.build());
+
+        for (uint32_t i = 0; i < num_swap_images_; i++) {
+            frame_buffers_.push_back(createWavefrontBuffers(width_ * height_));
+        }
+    }
+
+    // Whatever wasn't reused is too small for the new resolution.
+    device_buffer_pool_->trim();
+    host_buffer_pool_->trim();
+    CXL_LOG(INFO) << "NaivePathTracer pooled buffer memory: "
+                  << (device_buffer_pool_->allocatedBytes() + host_buffer_pool_->allocatedBytes()) / (1024 * 1024)
+                  << " MiB";
+
+    camera_ = Camera {
+        .position = glm::vec4(278, 273, -800, 1.0),
+        .direction = glm::vec4(0,0,1,0),
+        .focal_length = 0.035,
+        .width = 0.025,
+        .height = 0.025,
+        .x_res = width_,
+        .y_res = height_
+    };
+}
+
+NaivePathTracer::WavefrontBuffers NaivePathTracer::createWavefrontBuffers(uint32_t num_pixels) {
+    // The hits and shadow rays are reset by the camera kernel, so none of
+    // these need to be initialized here apart from the sorting counters.
+    WavefrontBuffers buffers;
+    buffers.rays = device_buffer_pool_->acquire(sizeof(Ray) * num_pixels);
+    buffers.hits = device_buffer_pool_->acquire(sizeof(HitPoint) * num_pixels);
+
+    ShadingQueues queues = {};
+    buffers.shading_queues = host_buffer_pool_->acquire(sizeof(ShadingQueues));
+    buffers.shading_queues->write(&queues, 1);
+    buffers.queue_indices = device_buffer_pool_->acquire(sizeof(uint32_t) * num_pixels);
+    buffers.shadow_rays = device_buffer_pool_->acquire(sizeof(ShadowRay) * num_pixels);
+    return buffers;
+}
+
+void NaivePathTracer::releaseWavefrontBuffers(WavefrontBuffers* buffers) {
+    device_buffer_pool_->release(std::move(buffers->rays));
+    device_buffer_pool_->release(std::move(buffers->hits));
+    host_buffer_pool_->release(std::move(buffers->shading_queues));
+    device_buffer_pool_->release(std::move(buffers->queue_indices));
+    device_buffer_pool_->release(std::move(buffers->shadow_rays));
+    *buffers = {};
+}
+
+void NaivePathTracer::buildSceneBuffers(const gfx::LogicalDevicePtr& logical_device) {
+    std::vector<TriangleRecord> triangles;
+    std::vector<MeshInfo> mesh_infos;
+    for (auto& mesh : meshes_) {
+        mesh.triangle_offset = triangles.size();
+        mesh_infos.push_back(MeshInfo(mesh.material, *mesh.bbox, triangles.size(), mesh.num_triangles, mesh.two_sided));
+        triangles.insert(triangles.end(), mesh.host_records.begin(), mesh.host_records.end());
+    }
+
+    scene_triangles_ = gfx::ComputeBuffer::createFromVector(logical_device, triangles, vk::BufferUsageFlagBits::eStorageBuffer);
+    scene_meshes_ = gfx::ComputeBuffer::createFromVector(logical_device, mesh_infos, vk::BufferUsageFlagBits::eStorageBuffer);
+}
+
+void NaivePathTracer::buildEmitters(const gfx::LogicalDevicePtr& logical_device) {
+    std::vector<EmitterTriangle> emitters;
+    std::vector<float> areas;
+    total_emitter_area_ = 0.f;
+    for (const auto& mesh : meshes_) {
+        if (glm::vec3(mesh.material.emissive_color) == glm::vec3(0.f)) {
+            continue;
+        }
+        for (const auto& record : mesh.host_records) {
+            glm::vec3 v0 = record.v0, v1 = record.v1, v2 = record.v2;
+            float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+            if (area == 0.f) {
+                continue;
+            }
+            total_emitter_area_ += area;
+            areas.push_back(total_emitter_area_);
+            emitters.push_back({
+                glm::vec4(v0, 0.f),
+                glm::vec4(v1, mesh.two_sided ? 1.f : 0.f),
+                glm::vec4(v2, 0.f),
+                mesh.material.emissive_color
+            });
+        }
+    }
+
+    // Normalize the running totals into the cdf used to pick emitters. The
+    // last one is set to exactly 1 so rounding can't leave a gap at the end.
+    for (uint32_t i = 0; i < emitters.size(); i++) {
+        emitters[i].v0.w = i + 1 == emitters.size() ? 1.f : areas[i] / total_emitter_area_;
+    }
+
+    num_emitters_ = emitters.size();
+    if (emitters.empty()) {
+        emitters.push_back({});
+    }
+    emitters_ = gfx::ComputeBuffer::createFromVector(logical_device, emitters, vk::BufferUsageFlagBits::eStorageBuffer);
+    CXL_LOG(INFO) << "NaivePathTracer emitter triangles: " << num_emitters_ << ", total area: " << total_emitter_area_;
+}
+
+void NaivePathTracer::buildMeshBVHs(const gfx::LogicalDevicePtr& logical_device) {
+    auto compute_buffer = compute_command_buffers_[0];
+    compute_buffer->reset();
+    compute_buffer->beginRecording();
+
+    uint32_t num_bvhs = 0;
+    uint32_t num_triangles = 0;
+    for (auto& mesh : meshes_) {
+        mesh.bvh.reset();
+        mesh.dynamic = bvh_mode_ == BVHMode::kAllMeshesRebuilt;
+        if (mesh.num_triangles == 0 ||
+            (bvh_mode_ == BVHMode::kLargeMeshes && mesh.num_triangles < kBVHMinTriangles)) {
+            continue;
+        }
+        mesh.bvh = lbvh_builder_->createBVH(mesh.num_triangles);
+        lbvh_builder_->recordBuild(compute_buffer, mesh.records, mesh.bvh.get());
+        num_bvhs++;
+        num_triangles += mesh.num_triangles;
+    }
+
+    compute_buffer->endRecording();
+    const auto start = std::chrono::steady_clock::now();
+    logical_device->getQueue(gfx::Queue::Type::kCompute).submit(compute_buffer);
+    logical_device->waitIdle();
+    const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (num_bvhs > 0) {
+        CXL_LOG(INFO) << "NaivePathTracer built " << num_bvhs << " BVHs over " << num_triangles
+                      << " triangles in " << elapsed.count() << " ms";
+    }
+}
+
+void NaivePathTracer::buildAccelerationStructure(const gfx::LogicalDevicePtr& logical_device) {
+    scene_as_ = std::make_shared<gfx::AccelerationStructure>(logical_device);
+    CXL_DCHECK(scene_as_);
+
+    // The triangle records are unindexed, so the primitive index reported by
+    // a ray query is the triangle's index within its mesh's records.
+    std::vector<gfx::GeomInstance> instances;
+    vk::BufferUsageFlags flags = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+    for (uint32_t i = 0; i < meshes_.size(); i++) {
+        std::vector<float> positions;
+        std::vector<uint32_t> indices;
+        for (const auto& record : meshes_[i].host_records) {
+            for (const auto& vertex : {record.v0, record.v1, record.v2}) {
+                positions.insert(positions.end(), {vertex.x, vertex.y, vertex.z});
+                indices.push_back(indices.size());
+            }
+        }
+
+        gfx::Geometry geometry;
+        geometry.positions = gfx::ComputeBuffer::createFromVector(logical_device, positions, flags);
+        geometry.indices = gfx::ComputeBuffer::createFromVector(logical_device, indices, flags);
+        geometry.num_indices = indices.size();
+        geometry.num_vertices = positions.size() / 3;
+        geometry.identifier = i + 1;
+        scene_as_->addGeometry(geometry);
+        scene_geometries_.push_back(geometry);
+
+        gfx::GeomInstance instance;
+        instance.identifier = i + 1;
+        instance.geometryID = geometry.identifier;
+        instance.custom_index = i;
+        instances.push_back(instance);
+    }
+
+    scene_as_->build(instances);
+}
+
+void NaivePathTracer::recordDynamicBVHBuilds(gfx::CommandBufferPtr compute_buffer) {
+    for (auto& mesh : meshes_) {
+        if (mesh.dynamic && mesh.bvh) {
+            lbvh_builder_->recordBuild(compute_buffer, mesh.records, mesh.bvh.get());
+        }
+    }
+}
+
+void NaivePathTracer::processEvent(display::InputEvent event) {
+    if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::M) {
+        trace_mode_ = trace_mode_ == TraceMode::kWavefront ? TraceMode::kMegakernel : TraceMode::kWavefront;
+        CXL_LOG(INFO) << "NaivePathTracer trace mode: "
+                      << (trace_mode_ == TraceMode::kWavefront ? "wavefront" : "megakernel");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::R) {
+        if (!ray_query_supported_) {
+            CXL_LOG(INFO) << "NaivePathTracer ray query backend unavailable: device lacks VK_KHR_ray_query";
+            return;
+        }
+        intersection_backend_ = intersection_backend_ == IntersectionBackend::kSoftware
+            ? IntersectionBackend::kRayQuery : IntersectionBackend::kSoftware;
+        restartErrorMeasurement();
+        CXL_LOG(INFO) << "NaivePathTracer intersection backend: "
+                      << (intersection_backend_ == IntersectionBackend::kSoftware ? "software" : "ray query");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::T) {
+        force_tiled_ = !force_tiled_;
+        logical_device_.lock()->waitIdle();
+        resize(width_, height_);
+        CXL_LOG(INFO) << "NaivePathTracer tiled rendering: " << (tiled_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::B) {
+        // Every mode finds the same hits, so the accumulation carries on.
+        bvh_mode_ = bvh_mode_ == BVHMode::kLargeMeshes ? BVHMode::kAllMeshes
+                  : bvh_mode_ == BVHMode::kAllMeshes ? BVHMode::kAllMeshesRebuilt
+                  : BVHMode::kLargeMeshes;
+        auto logical_device = logical_device_.lock();
+        logical_device->waitIdle();
+        buildMeshBVHs(logical_device);
+        CXL_LOG(INFO) << "NaivePathTracer BVHs: "
+                      << (bvh_mode_ == BVHMode::kLargeMeshes ? "large meshes"
+                          : bvh_mode_ == BVHMode::kAllMeshes ? "all meshes" : "all meshes, rebuilt every frame");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::E) {
+        // Both estimators converge to the same image, so the accumulation
+        // carries on across the switch unless the error is being measured.
+        next_event_estimation_ = !next_event_estimation_;
+        restartErrorMeasurement();
+        CXL_LOG(INFO) << "NaivePathTracer next event estimation: " << (next_event_estimation_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::X) {
+        // Both samplers converge to the same image, so the accumulation
+        // carries on across the switch too.
+        low_discrepancy_ = !low_discrepancy_;
+        CXL_LOG(INFO) << "NaivePathTracer sampler: " << (low_discrepancy_ ? "sobol" : "white noise");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::I) {
+        auto logical_device = logical_device_.lock();
+        logical_device->waitIdle();
+        benchmarkIntersection(logical_device);
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::Z) {
+        if (!tiled_) {
+            CXL_LOG(INFO) << "NaivePathTracer error measurements need tiled rendering, press T first";
+            return;
+        }
+        capture_reference_ = true;
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::Q) {
+        for (uint32_t bounce = 0; bounce < kMaxProfiledBounces; bounce++) {
+            CXL_LOG(INFO) << "bounce " << bounce
+                          << " diffuse: " << shading_queue_counts_[bounce][kMaterialDiffuse]
+                          << " emitter: " << shading_queue_counts_[bounce][kMaterialEmitter];
+        }
+    }
+}
+
+void NaivePathTracer::restartErrorMeasurement() {
+    if (!has_reference_) {
+        return;
+    }
+    // Frames still in flight were measured against the old clock.
+    error_measurements_.assign(num_swap_images_, ErrorMeasurement());
+    clear_tile_accumulation_ = true;
+    sample_ = 1;
+}
+
+void NaivePathTracer::readImageError(uint32_t image_index) {
+    ErrorMeasurement& measurement = error_measurements_[image_index];
+    if (measurement.samples == 0) {
+        return;
+    }
+
+    const uint32_t num_workgroups = (width_ * height_ + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize;
+    auto squared_errors = static_cast<const float*>(squared_errors_[image_index]->map());
+    double sum = 0.0;
+    for (uint32_t i = 0; i < num_workgroups; i++) {
+        sum += squared_errors[i];
+    }
+    squared_errors_[image_index]->unmap();
+
+    // The frame finished somewhere between its submission and now, so this
+    // overstates the time by at most the frames in flight.
+    const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - measurement_start_;
+    double rmse = std::sqrt(sum / (3.0 * width_ * height_));
+    CXL_LOG(INFO) << "NaivePathTracer next event estimation " << (measurement.next_event_estimation ? "on" : "off")
+                  << ", " << (measurement.ray_query ? "ray query" : "software") << " shadow rays"
+                  << ": rmse " << rmse << " at " << measurement.samples << " spp after " << elapsed.count() << " ms";
+    measurement.samples = 0;
+}
+
+void NaivePathTracer::readShadingQueueCounts(uint32_t image_index) {
+    // The command buffer for |image_index| has finished executing by the time
+    // it is reset for reuse, so the counters it wrote are safe to read.
+    auto queues = static_cast<const ShadingQueues*>(frame_buffers_[image_index].shading_queues->map());
+    for (uint32_t bounce = 0; bounce < kMaxProfiledBounces; bounce++) {
+        for (uint32_t type = 0; type < kNumMaterialTypes; type++) {
+            shading_queue_counts_[bounce][type] = queues->history[bounce * kNumMaterialTypes + type];
+        }
+    }
+    frame_buffers_[image_index].shading_queues->unmap();
+}
+
+void NaivePathTracer::recordRayGeneration(gfx::CommandBufferPtr compute_buffer, const WavefrontBuffers& buffers,
+                                          glm::uvec2 tile_offset, glm::uvec2 tile_extent, uint32_t sample,
+                                          bool keep_accumulation) {
+    uint32_t keep = keep_accumulation;
+    uint32_t low_discrepancy = low_discrepancy_;
+    compute_buffer->setProgram(ray_generator_->program());
+    compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+    compute_buffer->bindUniformBuffer(0, 2, buffers.hits);
+    compute_buffer->bindUniformBuffer(0, 3, buffers.shadow_rays);
+    compute_buffer->pushConstants(camera_);
+    compute_buffer->pushConstants(tile_offset, sizeof(Camera));
+    compute_buffer->pushConstants(tile_extent, sizeof(Camera) + sizeof(glm::uvec2));
+    compute_buffer->pushConstants(keep, sizeof(Camera) + 2 * sizeof(glm::uvec2));
+    compute_buffer->pushConstants(sample, sizeof(Camera) + 2 * sizeof(glm::uvec2) + sizeof(uint32_t));
+    compute_buffer->pushConstants(low_discrepancy, sizeof(Camera) + 2 * sizeof(glm::uvec2) + 2 * sizeof(uint32_t));
+    compute_buffer->dispatch((tile_extent.x + 31) / 32, (tile_extent.y + 31) / 32, 1);
+}
+
+void NaivePathTracer::benchmarkIntersection(const gfx::LogicalDevicePtr& logical_device) {
+    // The reference kernel reads an index buffer and a vertex buffer. These
+    // are built from the records, so vertices aren't shared between
+    // triangles, but every test still goes through the index.
+    std::vector<gfx::ComputeBufferPtr> vertex_buffers(meshes_.size());
+    std::vector<gfx::ComputeBufferPtr> index_buffers(meshes_.size());
+    for (uint32_t j = 0; j < meshes_.size(); j++) {
+        if (meshes_[j].num_triangles == 0) {
+            continue;
+        }
+        std::vector<glm::vec4> vertices;
+        std::vector<glm::ivec4> indices;
+        for (const auto& record : meshes_[j].host_records) {
+            const int32_t first = vertices.size();
+            vertices.insert(vertices.end(), {glm::vec4(glm::vec3(record.v0), 1.f),
+                                             glm::vec4(glm::vec3(record.v1), 1.f),
+                                             glm::vec4(glm::vec3(record.v2), 1.f)});
+            indices.push_back(glm::ivec4(first, first + 1, first + 2, 0));
+        }
+        vertex_buffers[j] = gfx::ComputeBuffer::createFromVector(logical_device, vertices,
+                                                                 vk::BufferUsageFlagBits::eStorageBuffer);
+        index_buffers[j] = gfx::ComputeBuffer::createFromVector(logical_device, indices,
+                                                                vk::BufferUsageFlagBits::eStorageBuffer);
+    }
+
+    // Camera rays for the whole image, or the first tile when tiled.
+    const WavefrontBuffers& buffers = tiled_ ? tile_buffers_[0] : frame_buffers_[0];
+    const glm::uvec2 extent = tiled_ ? glm::min(glm::uvec2(kTileSize), glm::uvec2(width_, height_))
+                                     : glm::uvec2(width_, height_);
+    const uint32_t num_rays = extent.x * extent.y;
+    const uint32_t num_workgroups = (num_rays + 511) / 512;
+    uint64_t num_tests = 0;
+    for (const auto& mesh : meshes_) {
+        num_tests += mesh.num_triangles;
+    }
+    num_tests *= num_rays;
+
+    auto compute_buffer = compute_command_buffers_[0];
+    auto time_kernel = [&](bool records) {
+        compute_buffer->reset();
+        compute_buffer->beginRecording();
+        recordRayGeneration(compute_buffer, buffers, glm::uvec2(0), extent, sample_);
+        compute_buffer->endRecording();
+        logical_device->getQueue(gfx::Queue::Type::kCompute).submit(compute_buffer);
+        logical_device->waitIdle();
+
+        // Every mesh gets the brute force kernel here, and the two sided
+        // flag is dropped so that both kernels cull the same back faces.
+        compute_buffer->reset();
+        compute_buffer->beginRecording();
+        for (uint32_t k = 0; k < kBenchmarkRepetitions; k++) {
+            for (uint32_t j = 0; j < meshes_.size(); j++) {
+                if (meshes_[j].num_triangles == 0) {
+                    continue;
+                }
+                uint32_t material = packHitMaterial(j, meshes_[j].material.type());
+                uint32_t two_sided = 0;
+                if (records) {
+                    compute_buffer->setProgram(hit_tester_->program());
+                    compute_buffer->bindUniformBuffer(1, 0, meshes_[j].records);
+                } else {
+                    compute_buffer->setProgram(indexed_hit_tester_->program());
+                    compute_buffer->bindUniformBuffer(1, 0, vertex_buffers[j]);
+                    compute_buffer->bindUniformBuffer(1, 1, index_buffers[j]);
+                }
+                compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+                compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+                compute_buffer->pushConstants(*meshes_[j].bbox);
+                compute_buffer->pushConstants(meshes_[j].num_triangles, sizeof(BoundingBox));
+                compute_buffer->pushConstants(meshes_[j].triangle_offset, sizeof(BoundingBox) + sizeof(uint32_t));
+                compute_buffer->pushConstants(material, sizeof(BoundingBox) + 2 * sizeof(uint32_t));
+                compute_buffer->pushConstants(two_sided, sizeof(BoundingBox) + 3 * sizeof(uint32_t));
+                compute_buffer->pushConstants(num_rays, sizeof(BoundingBox) + 4 * sizeof(uint32_t));
+                compute_buffer->dispatch(num_workgroups, 1, 1);
+            }
+        }
+        compute_buffer->endRecording();
+
+        const auto start = std::chrono::steady_clock::now();
+        logical_device->getQueue(gfx::Queue::Type::kCompute).submit(compute_buffer);
+        logical_device->waitIdle();
+        const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        const float ms = elapsed.count() / kBenchmarkRepetitions;
+        CXL_LOG(INFO) << "NaivePathTracer " << (records ? "watertight records" : "indexed Moller-Trumbore")
+                      << ": " << ms << " ms per pass, "
+                      << num_tests / (ms * 1e6f) << " G tests/s";
+    };
+
+    CXL_LOG(INFO) << "NaivePathTracer timing " << kBenchmarkRepetitions << " brute force intersection passes of "
+                  << num_rays << " camera rays";
+    time_kernel(/*records*/false);
+    time_kernel(/*records*/true);
+}
+
+void NaivePathTracer::recordWavefront(gfx::CommandBufferPtr compute_buffer, const WavefrontBuffers& buffers,
+                                      glm::uvec2 tile_offset, glm::uvec2 tile_extent, uint32_t sample,
+                                      bool keep_accumulation) {
+    recordRayGeneration(compute_buffer, buffers, tile_offset, tile_extent, sample, keep_accumulation);
+
+    // Every kernel below exits early for threads past |num_threads|, since
+    // the last workgroup is usually only partly filled.
+    uint32_t num_threads = tile_extent.x * tile_extent.y;
+    uint32_t num_workgroups = (num_threads + 511) / 512;
+    uint32_t next_event_estimation = next_event_estimation_ && num_emitters_ > 0;
+    uint32_t low_discrepancy = low_discrepancy_;
+    for (uint32_t i = 0; i < MAX_BOUNCES; i++) {
+        // Hit testing.
+        if (intersection_backend_ == IntersectionBackend::kRayQuery) {
+            compute_buffer->setProgram(ray_query_hit_tester_->program());
+            compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+            compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+            compute_buffer->bindAccelerationStructure(1, 0, scene_as_);
+            compute_buffer->bindUniformBuffer(1, 1, scene_triangles_);
+            compute_buffer->bindUniformBuffer(1, 2, scene_meshes_);
+            compute_buffer->pushConstants(num_threads);
+            compute_buffer->dispatch(num_workgroups, 1, 1);
+        } else {
+            for (uint32_t j = 0; j < meshes_.size(); j++) {
+                uint32_t material = packHitMaterial(j, meshes_[j].material.type());
+                uint32_t two_sided = meshes_[j].two_sided;
+                if (meshes_[j].bvh) {
+                    compute_buffer->setProgram(bvh_hit_tester_->program());
+                    compute_buffer->bindUniformBuffer(1, 1, meshes_[j].bvh->nodes);
+                } else if (meshes_[j].num_triangles < kTiledIntersectionMaxTriangles) {
+                    compute_buffer->setProgram(tiled_hit_tester_->program());
+                } else {
+                    compute_buffer->setProgram(hit_tester_->program());
+                }
+                compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+                compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+                compute_buffer->bindUniformBuffer(1, 0, meshes_[j].records);
+                compute_buffer->pushConstants(*meshes_[j].bbox);
+                compute_buffer->pushConstants(meshes_[j].num_triangles, sizeof(BoundingBox));
+                compute_buffer->pushConstants(meshes_[j].triangle_offset, sizeof(BoundingBox) + sizeof(uint32_t));
+                compute_buffer->pushConstants(material, sizeof(BoundingBox) + 2 * sizeof(uint32_t));
+                compute_buffer->pushConstants(two_sided, sizeof(BoundingBox) + 3 * sizeof(uint32_t));
+                compute_buffer->pushConstants(num_threads, sizeof(BoundingBox) + 4 * sizeof(uint32_t));
+                compute_buffer->dispatch(num_workgroups, 1, 1);
+            }
+        }
+
+        // Bin the hits by material type with a counting sort.
+        compute_buffer->setProgram(material_counter_->program());
+        compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+        compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+        compute_buffer->bindUniformBuffer(0, 3, buffers.shading_queues);
+        compute_buffer->pushConstants(num_threads);
+        compute_buffer->dispatch(num_workgroups, 1, 1);
+
+        compute_buffer->setProgram(material_scanner_->program());
+        compute_buffer->bindUniformBuffer(0, 3, buffers.shading_queues);
+        compute_buffer->pushConstants(i);
+        compute_buffer->dispatch(1, 1, 1);
+
+        compute_buffer->setProgram(material_scatterer_->program());
+        compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+        compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+        compute_buffer->bindUniformBuffer(0, 3, buffers.shading_queues);
+        compute_buffer->bindUniformBuffer(0, 4, buffers.queue_indices);
+        compute_buffer->pushConstants(num_threads);
+        compute_buffer->dispatch(num_workgroups, 1, 1);
+
+        // Shade each queue with its own dispatch so every thread in it runs
+        // the same code path. The queue sizes are only known on the GPU, so
+        // each dispatch covers the worst case and surplus threads exit early.
+        compute_buffer->setProgram(bouncer_->program());
+        compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+        compute_buffer->bindUniformBuffer(0, 1, buffers.hits);
+        compute_buffer->bindUniformBuffer(0, 3, buffers.shading_queues);
+        compute_buffer->bindUniformBuffer(0, 4, buffers.queue_indices);
+        compute_buffer->bindUniformBuffer(0, 5, emitters_);
+        compute_buffer->bindUniformBuffer(0, 6, buffers.shadow_rays);
+        compute_buffer->bindUniformBuffer(1, 0, scene_meshes_);
+        compute_buffer->pushConstants(num_emitters_, sizeof(uint32_t));
+        compute_buffer->pushConstants(total_emitter_area_, 2 * sizeof(uint32_t));
+        compute_buffer->pushConstants(next_event_estimation, 3 * sizeof(uint32_t));
+        compute_buffer->pushConstants(tile_offset, 4 * sizeof(uint32_t));
+        compute_buffer->pushConstants(tile_extent, 4 * sizeof(uint32_t) + sizeof(glm::uvec2));
+        compute_buffer->pushConstants(width_, 4 * sizeof(uint32_t) + 2 * sizeof(glm::uvec2));
+        compute_buffer->pushConstants(sample, 5 * sizeof(uint32_t) + 2 * sizeof(glm::uvec2));
+        compute_buffer->pushConstants(i, 6 * sizeof(uint32_t) + 2 * sizeof(glm::uvec2));
+        compute_buffer->pushConstants(low_discrepancy, 7 * sizeof(uint32_t) + 2 * sizeof(glm::uvec2));
+        for (uint32_t type = 0; type < kNumMaterialTypes; type++) {
+            compute_buffer->pushConstants(type);
+            compute_buffer->dispatch(num_workgroups, 1, 1);
+        }
+
+        // Resolve the visibility of the light samples taken while shading,
+        // through the same traversal as the hit testing above.
+        if (next_event_estimation) {
+            if (intersection_backend_ == IntersectionBackend::kRayQuery) {
+                compute_buffer->setProgram(ray_query_shadow_tester_->program());
+                compute_buffer->bindUniformBuffer(0, 1, buffers.shadow_rays);
+                compute_buffer->bindAccelerationStructure(1, 0, scene_as_);
+                compute_buffer->bindUniformBuffer(1, 1, scene_triangles_);
+                compute_buffer->bindUniformBuffer(1, 2, scene_meshes_);
+                compute_buffer->pushConstants(num_threads);
+                compute_buffer->dispatch(num_workgroups, 1, 1);
+            } else {
+                for (const auto& mesh : meshes_) {
+                    uint32_t two_sided = mesh.two_sided;
+                    if (mesh.bvh) {
+                        compute_buffer->setProgram(bvh_shadow_tester_->program());
+                        compute_buffer->bindUniformBuffer(1, 1, mesh.bvh->nodes);
+                    } else {
+                        compute_buffer->setProgram(shadow_tester_->program());
+                    }
+                    compute_buffer->bindUniformBuffer(0, 1, buffers.shadow_rays);
+                    compute_buffer->bindUniformBuffer(1, 0, mesh.records);
+                    compute_buffer->pushConstants(*mesh.bbox);
+                    compute_buffer->pushConstants(mesh.num_triangles, sizeof(BoundingBox));
+                    compute_buffer->pushConstants(two_sided, sizeof(BoundingBox) + sizeof(uint32_t));
+                    compute_buffer->pushConstants(num_threads, sizeof(BoundingBox) + 2 * sizeof(uint32_t));
+                    compute_buffer->dispatch(num_workgroups, 1, 1);
+                }
+            }
+
+            compute_buffer->setProgram(shadow_resolver_->program());
+            compute_buffer->bindUniformBuffer(0, 0, buffers.rays);
+            compute_buffer->bindUniformBuffer(0, 1, buffers.shadow_rays);
+            compute_buffer->pushConstants(num_threads);
+            compute_buffer->dispatch(num_workgroups, 1, 1);
+        }
+    }
+}
+
+void NaivePathTracer::recordMegakernel(gfx::CommandBufferPtr compute_buffer, uint32_t image_index) {
+    uint32_t zero = 0;
+    work_queues_[image_index]->write(&zero, 1);
+
+    uint32_t num_meshes = meshes_.size();
+    uint32_t max_bounces = MAX_BOUNCES;
+    uint32_t next_event_estimation = next_event_estimation_;
+    uint32_t low_discrepancy = low_discrepancy_;
+    compute_buffer->setProgram(megakernel_->program());
+    compute_buffer->bindUniformBuffer(0, 0, frame_buffers_[image_index].rays);
+    compute_buffer->bindUniformBuffer(0, 2, work_queues_[image_index]);
+    compute_buffer->bindUniformBuffer(1, 0, scene_triangles_);
+    compute_buffer->bindUniformBuffer(1, 1, scene_meshes_);
+    compute_buffer->bindUniformBuffer(1, 2, emitters_);
+    compute_buffer->pushConstants(camera_);
+    compute_buffer->pushConstants(num_meshes, sizeof(Camera));
+    compute_buffer->pushConstants(max_bounces, sizeof(Camera) + sizeof(uint32_t));
+    compute_buffer->pushConstants(samples_per_frame_, sizeof(Camera) + 2 * sizeof(uint32_t));
+    compute_buffer->pushConstants(num_emitters_, sizeof(Camera) + 3 * sizeof(uint32_t));
+    compute_buffer->pushConstants(total_emitter_area_, sizeof(Camera) + 4 * sizeof(uint32_t));
+    compute_buffer->pushConstants(next_event_estimation, sizeof(Camera) + 5 * sizeof(uint32_t));
+    compute_buffer->pushConstants(sample_, sizeof(Camera) + 6 * sizeof(uint32_t));
+    compute_buffer->pushConstants(low_discrepancy, sizeof(Camera) + 7 * sizeof(uint32_t));
+    compute_buffer->dispatch(kMegakernelWorkgroups, 1, 1);
+}
+
+void NaivePathTracer::recordTiled(gfx::CommandBufferPtr compute_buffer, uint32_t image_index) {
+    // |tile_accum_texture_| is shared by every frame. Frames are submitted to
+    // the one compute queue in order, and each dispatch is barriered against
+    // the work submitted before it, previous frames' tiles included.
+    const auto& tile_buffers = tile_buffers_[image_index];
+    const auto& tile_resolve_texture = tile_resolve_textures_[image_index];
+    const uint32_t num_error_workgroups = (width_ * height_ + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize;
+    readImageError(image_index);
+
+    // The reference is whatever has accumulated up to this frame, after
+    // which the accumulation starts over to be measured against it.
+    if (capture_reference_) {
+        uint32_t stage = 0;
+        compute_buffer->setProgram(error_meter_->program());
+        compute_buffer->bindStorageImage(0, 0, tile_accum_texture_);
+        compute_buffer->bindStorageImage(0, 1, reference_texture_);
+        compute_buffer->bindUniformBuffer(0, 2, squared_errors_[image_index]);
+        compute_buffer->pushConstants(width_);
+        compute_buffer->pushConstants(height_, 4u);
+        compute_buffer->pushConstants(stage, 8u);
+        compute_buffer->dispatch(num_error_workgroups, 1, 1);
+        CXL_LOG(INFO) << "NaivePathTracer captured the reference at " << sample_ - 1 << " spp";
+        capture_reference_ = false;
+        has_reference_ = true;
+        clear_tile_accumulation_ = true;
+        sample_ = 1;
+    }
+
+    if (clear_tile_accumulation_) {
+        compute_buffer->clearColorImage(tile_accum_texture_, {0,0,0,0});
+        clear_tile_accumulation_ = false;
+        measurement_start_ = std::chrono::steady_clock::now();
+    }
+
+    tile_resolve_texture->transitionImageLayout(*compute_buffer.get(), vk::ImageLayout::eGeneral);
+
+    glm::uvec2 image_extent(width_, height_);
+    glm::uvec2 tile_extent(kTileSize, kTileSize);
+    uint32_t total_samples = sample_ + samples_per_frame_ - 1;
+    for (uint32_t y = 0; y < height_; y += kTileSize) {
+        for (uint32_t x = 0; x < width_; x += kTileSize) {
+            glm::uvec2 tile_offset(x, y);
+            for (uint32_t s = 0; s < samples_per_frame_; s++) {
+                recordWavefront(compute_buffer, tile_buffers, tile_offset, tile_extent, sample_ + s,
+                                /*keep_accumulation*/s > 0);
+            }
+
+            // Fold the tile into the full resolution image before the next
+            // tile overwrites its rays.
+            compute_buffer->setProgram(tile_accumulator_->program());
+            compute_buffer->bindUniformBuffer(0, 0, tile_buffers.rays);
+            compute_buffer->bindStorageImage(0, 1, tile_accum_texture_);
+            compute_buffer->bindStorageImage(0, 2, tile_resolve_texture);
+            compute_buffer->pushConstants(tile_offset);
+            compute_buffer->pushConstants(tile_extent, sizeof(glm::uvec2));
+            compute_buffer->pushConstants(image_extent, 2 * sizeof(glm::uvec2));
+            compute_buffer->pushConstants(total_samples, 3 * sizeof(glm::uvec2));
+            compute_buffer->dispatch((kTileSize * kTileSize + 511) / 512, 1, 1);
+        }
+    }
+
+    // Measure the error whenever the sample count passes a power of two.
+    if (has_reference_ && std::bit_floor(total_samples) >= sample_) {
+        uint32_t stage = 1;
+        compute_buffer->setProgram(error_meter_->program());
+        compute_buffer->bindStorageImage(0, 0, tile_accum_texture_);
+        compute_buffer->bindStorageImage(0, 1, reference_texture_);
+        compute_buffer->bindUniformBuffer(0, 2, squared_errors_[image_index]);
+        compute_buffer->pushConstants(width_);
+        compute_buffer->pushConstants(height_, 4u);
+        compute_buffer->pushConstants(stage, 8u);
+        compute_buffer->dispatch(num_error_workgroups, 1, 1);
+        error_measurements_[image_index] = {total_samples, next_event_estimation_ && num_emitters_ > 0,
+                                            intersection_backend_ == IntersectionBackend::kRayQuery};
+    }
+
+    tile_resolve_texture->transitionImageLayout(*compute_buffer.get(), vk::ImageLayout::eShaderReadOnlyOptimal);
 }
 
 gfx::ComputeTexturePtr NaivePathTracer::renderFrame(gfx::CommandBufferPtr command_buffer, 
@@ -263,30 +1041,23 @@ gfx::ComputeTexturePtr NaivePathTracer::renderFrame(gfx::CommandBufferPtr comman
     compute_buffer->reset();
     compute_buffer->beginRecording();
 
-    // Generate rays.
-    compute_buffer->setProgram(ray_generator_->program());
-    compute_buffer->bindUniformBuffer(0, 0, rays_[image_index]);
-    compute_buffer->bindUniformBuffer(0, 1, random_seeds_[image_index]);
-    compute_buffer->pushConstants(camera_);
-    compute_buffer->dispatch(width_ / 32, height_ / 32, 1);
+    recordDynamicBVHBuilds(compute_buffer);
 
-    // Hit testing.
-    for (uint32_t i = 0; i < MAX_BOUNCES; i++) {
-        compute_buffer->setProgram(hit_tester_->program());
-        compute_buffer->bindUniformBuffer(0, 0, rays_[image_index]);
-        compute_buffer->bindUniformBuffer(0, 1, hits_[image_index]);
-        for (uint32_t j = 0; j < meshes_.size(); j++) {
-            compute_buffer->bindUniformBuffer(1, 0, meshes_[j].vertices);
-            compute_buffer->bindUniformBuffer(1, 1, meshes_[j].triangles);
-            compute_buffer->pushConstants(meshes_[j].material);
-            compute_buffer->pushConstants(meshes_[j].bbox, sizeof(Material));
-            compute_buffer->pushConstants(meshes_[j].num_triangles, sizeof(Material) + sizeof(BoundingBox));
-            compute_buffer->dispatch(width_ * height_ / 512, 1, 1);
+    // The megakernel needs full resolution buffers, so tiled frames are
+    // always traced with the wavefront kernels.
+    if (tiled_) {
+        recordTiled(compute_buffer, image_index);
+    } else if (trace_mode_ == TraceMode::kMegakernel) {
+        recordMegakernel(compute_buffer, image_index);
+    } else {
+        // Chain one full wavefront pass per sample, each adding onto the
+        // radiance left in the ray buffer by the one before it.
+        readShadingQueueCounts(image_index);
+        for (uint32_t s = 0; s < samples_per_frame_; s++) {
+            recordWavefront(compute_buffer, frame_buffers_[image_index],
+                            glm::uvec2(0, 0), glm::uvec2(width_, height_), sample_ + s,
+                            /*keep_accumulation*/s > 0);
         }
-
-        compute_buffer->setProgram(bouncer_->program());
-        compute_buffer->bindUniformBuffer(0, 2, random_seeds_[image_index]);
-        compute_buffer->dispatch(width_ * height_ / 512, 1, 1);
     }
 
     compute_buffer->endRecording();
@@ -304,13 +1075,19 @@ gfx::ComputeTexturePtr NaivePathTracer::renderFrame(gfx::CommandBufferPtr comman
         signal_wait_stages->push_back(vk::PipelineStageFlagBits::eComputeShader);
     }
 
+    // Tiles have already been accumulated and resolved on the compute queue.
+    if (tiled_) {
+        sample_ += samples_per_frame_;
+        return tile_resolve_textures_[image_index];
+    }
+
     // Render to the accumulation buffer.
     resolve_texture_->transitionImageLayout(*command_buffer.get(), vk::ImageLayout::eColorAttachmentOptimal);
     command_buffer->beginRenderPass(render_pass_); 
     command_buffer->setProgram(lighter_->program());
     command_buffer->setDefaultState(gfx::CommandBufferState::DefaultState::kCustomRaytrace);
     command_buffer->setDepth(/*test*/ false, /*write*/ false);
-    command_buffer->bindUniformBuffer(0, 0, rays_[image_index]);
+    command_buffer->bindUniformBuffer(0, 0, frame_buffers_[image_index].rays);
     command_buffer->draw(width_ * height_);
 
     // Average out the accumulation buffer.
@@ -318,9 +1095,10 @@ gfx::ComputeTexturePtr NaivePathTracer::renderFrame(gfx::CommandBufferPtr comman
     command_buffer->setProgram(resolve_->program());
     command_buffer->setDefaultState(gfx::CommandBufferState::DefaultState::kOpaque);
     command_buffer->bindInputAttachment(0, 0, accum_texture_);
-    command_buffer->pushConstants(sample_);
+    uint32_t total_samples = sample_ + samples_per_frame_ - 1;
+    command_buffer->pushConstants(total_samples);
     command_buffer->draw(3);
-    sample_++;
+    sample_ += samples_per_frame_;
 
     command_buffer->endRenderPass();
     resolve_texture_->transitionImageLayout(*command_buffer.get(), vk::ImageLayout::eShaderReadOnlyOptimal); 
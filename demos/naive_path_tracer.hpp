@@ -6,12 +6,17 @@
 #ifndef NAIVE_PATH_TRACER_HPP_
 #define NAIVE_PATH_TRACER_HPP_
 
+#include <array>
+#include <chrono>
 #include <string>
 #include "demo.hpp"
 #include "src/text_renderer.hpp"
 #include "src/shader_resource.hpp"
 #include "src/model.hpp"
+#include "src/buffer_pool.hpp"
+#include "src/lbvh_builder.hpp"
 #include <UsefulUtils/dispatch_queue.hpp>
+#include <VulkanWrappers/acceleration_structure.hpp>
 
 class NaivePathTracer : public Demo {
 
@@ -33,10 +38,53 @@ public:
     std::string name() override { return "NaivePathTracer"; }
 
 
-    void processEvent(display::InputEvent event) override {}
+    void processEvent(display::InputEvent event) override;
+
+    // Shading code paths, in the order their queues are dispatched. These
+    // must match the constants in types/shape.comp.
+    enum MaterialType : uint32_t {
+        kMaterialDiffuse = 0,
+        kMaterialEmitter = 1,
+        kNumMaterialTypes = 2,
+    };
+
+    static constexpr uint32_t kMaxProfiledBounces = 8;
+
+    // Number of hits shaded by each material queue, per bounce, for the most
+    // recently completed frame of the wavefront mode.
+    using ShadingQueueCounts = std::array<std::array<uint32_t, kNumMaterialTypes>, kMaxProfiledBounces>;
+    const ShadingQueueCounts& shadingQueueCounts() const { return shading_queue_counts_; }
 
 private:
 
+    // How paths are traced on the GPU. The wavefront mode runs each stage of
+    // each bounce as a separate dispatch, the megakernel mode traces whole
+    // paths in a persistent grid of workgroups.
+    enum class TraceMode {
+        kWavefront,
+        kMegakernel,
+    };
+
+    // How the wavefront mode finds the closest hit. Software traversal runs
+    // the hit testing kernels once per mesh, ray query traversal runs a single
+    // VK_KHR_ray_query dispatch against the scene's acceleration structure.
+    enum class IntersectionBackend {
+        kSoftware,
+        kRayQuery,
+    };
+
+    // Which meshes software traversal intersects through a BVH. None of the
+    // scene's meshes is large enough to get one by default, so the other
+    // modes exist to exercise and time the GPU builds.
+    enum class BVHMode {
+        // Static meshes with at least kBVHMinTriangles triangles.
+        kLargeMeshes,
+        // Every mesh, built once.
+        kAllMeshes,
+        // Every mesh, rebuilt at the start of every frame as if dynamic.
+        kAllMeshesRebuilt,
+    };
+
     struct Camera {
         alignas(16) glm::vec4 position;
         alignas(16) glm::vec4 direction;
@@ -54,22 +102,55 @@ private:
         alignas(16) glm::vec4 accumulation;
         alignas(8) glm::vec2 coord;
         int32_t valid = true;
+        float bsdf_pdf = 0.f;
+    };
+
+    // Mirrors ShadowRay in types/ray.comp.
+    struct ShadowRay {
+        alignas(16) glm::vec4 origin;
+        alignas(16) glm::vec4 direction;
+        alignas(16) glm::vec4 contribution;
+        alignas(16) int32_t valid = false;
     };
  
+    // Mirrors HitPoint in types/intersection.comp.
     struct HitPoint {
-        alignas(16) glm::vec4 pos = glm::vec4(0.f, 0.f, 0.f, 1.f);
-        alignas(16) glm::vec4 norm = glm::vec4(0.f);
-        alignas(16) glm::vec4 col = glm::vec4(0.f);
-        alignas(16) glm::vec4 emission = glm::vec4(0.f);
         alignas(4) float t = -1;
+        alignas(4) uint32_t primitive = 0;
+        alignas(4) uint32_t material = 0;
+        alignas(4) uint32_t normal = 0;
+        alignas(8) glm::vec2 barycentrics = glm::vec2(0.f);
     };
 
+    // Packs a mesh's index into the material table together with its
+    // material type, the way packHitMaterial in types/intersection.comp does.
+    static uint32_t packHitMaterial(uint32_t material_index, uint32_t material_type) {
+        CXL_DCHECK(material_index <= 0xFFFF);
+        return (material_type << 16) | material_index;
+    }
+
     struct Material {
         Material(glm::vec4 diffuse, glm::vec4 emissive = glm::vec4(0)) 
         : diffuse_color(diffuse)
         , emissive_color(emissive) {}
         alignas(16) glm::vec4 diffuse_color = glm::vec4(0.f);
         alignas(16) glm::vec4 emissive_color = glm::vec4(0.f);
+
+        // Surfaces that only emit light are shaded separately, since their
+        // paths end as soon as they are hit.
+        MaterialType type() const {
+            return diffuse_color == glm::vec4(0.f) && emissive_color != glm::vec4(0.f)
+                ? kMaterialEmitter : kMaterialDiffuse;
+        }
+    };
+
+    // Mirrors ShadingQueues in types/shading_queue.comp.
+    struct ShadingQueues {
+        uint32_t counts[kNumMaterialTypes];
+        uint32_t sizes[kNumMaterialTypes];
+        uint32_t offsets[kNumMaterialTypes];
+        uint32_t cursors[kNumMaterialTypes];
+        uint32_t history[kMaxProfiledBounces * kNumMaterialTypes];
     };
 
     struct BoundingBox {
@@ -88,39 +169,79 @@ private:
     };
 
 
+    // Mirrors TriangleRecord in types/shape.comp. The vertex positions are
+    // stored directly in the record so the intersection kernels don't have to
+    // go through an index buffer, and the w components hold the normalized
+    // geometric normal.
+    struct TriangleRecord {
+        alignas(16) glm::vec4 v0;
+        alignas(16) glm::vec4 v1;
+        alignas(16) glm::vec4 v2;
+    };
+
+    // Mirrors EmitterTriangle in types/shape.comp. v0.w is the normalized
+    // running total of the emitter areas, v1.w is non-zero when two sided.
+    struct EmitterTriangle {
+        alignas(16) glm::vec4 v0;
+        alignas(16) glm::vec4 v1;
+        alignas(16) glm::vec4 v2;
+        alignas(16) glm::vec4 radiance;
+    };
+
     struct Mesh {
         Mesh(gfx::LogicalDevicePtr logical_device, 
             std::vector<glm::vec4> in_vertices,
             std::vector<uint32_t> in_indices,
-            Material in_material) 
-            : material(in_material) {
+            Material in_material,
+            bool in_two_sided = false) 
+            : material(in_material)
+            , two_sided(in_two_sided) {
                 bbox = BoundingBox(in_vertices);
-                vertices = gfx::ComputeBuffer::createFromVector(
-                                logical_device, in_vertices, vk::BufferUsageFlagBits::eStorageBuffer);
-                
-                std::vector<glm::ivec4> in_triangles;
+
+                std::vector<TriangleRecord> in_records;
                 CXL_DCHECK(in_indices.size() % 3 == 0);
                 for (uint32_t i = 0; i < in_indices.size(); i += 3) {
-                    in_triangles.push_back(glm::ivec4(
-                        in_indices[i],
-                        in_indices[i+1],
-                        in_indices[i+2],
-                        0U
-                    ));
+                    glm::vec3 v0 = in_vertices[in_indices[i]];
+                    glm::vec3 v1 = in_vertices[in_indices[i+1]];
+                    glm::vec3 v2 = in_vertices[in_indices[i+2]];
+                    glm::vec3 normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+                    in_records.push_back({
+                        glm::vec4(v0, normal.x),
+                        glm::vec4(v1, normal.y),
+                        glm::vec4(v2, normal.z)
+                    });
                 }
-                
-                num_triangles = in_indices.size() / 3;
-                triangles = gfx::ComputeBuffer::createFromVector(
-                                logical_device, in_triangles, vk::BufferUsageFlagBits::eStorageBuffer);
 
+                num_triangles = in_records.size();
+                records = gfx::ComputeBuffer::createFromVector(
+                                logical_device, in_records, vk::BufferUsageFlagBits::eStorageBuffer);
+
+                host_records = std::move(in_records);
         }
 
         Material material;
         std::optional<BoundingBox> bbox;
-        gfx::ComputeBufferPtr vertices;
-        gfx::ComputeBufferPtr triangles;
+        gfx::ComputeBufferPtr records;
         uint32_t num_triangles;
 
+        // Two sided meshes can be hit from either side, all others have their
+        // back faces culled.
+        bool two_sided;
+
+        // Dynamic meshes have their BVH rebuilt on the GPU every frame, so
+        // their triangle records can be rewritten between frames.
+        bool dynamic = false;
+
+        // Only built for the meshes |bvh_mode_| selects.
+        std::shared_ptr<christalz::LBVHBuilder::BVH> bvh;
+
+        // CPU copy, used to build the packed scene buffers.
+        std::vector<TriangleRecord> host_records;
+
+        // Index of the mesh's first record in the packed scene buffer, which
+        // is what hit primitive IDs are relative to.
+        uint32_t triangle_offset = 0;
+
         static Mesh createRectangle(gfx::LogicalDevicePtr logical_device,
                                     glm::vec4 v0, 
                                     glm::vec4 v1, 
@@ -133,14 +254,133 @@ private:
 
 
 
+    // Mirrors MeshInfo in types/shape.comp.
+    struct MeshInfo {
+        MeshInfo(const Material& in_material, const BoundingBox& in_bbox,
+                 int32_t in_triangle_offset, int32_t in_num_triangles, bool in_two_sided)
+        : material(in_material)
+        , min_pos(in_bbox.min_pos)
+        , max_pos(in_bbox.max_pos)
+        , triangle_offset(in_triangle_offset)
+        , num_triangles(in_num_triangles)
+        , material_type(in_material.type())
+        , two_sided(in_two_sided) {}
+        alignas(16) Material material;
+        alignas(16) glm::vec4 min_pos;
+        alignas(16) glm::vec4 max_pos;
+        alignas(4) int32_t triangle_offset;
+        alignas(4) int32_t num_triangles;
+        alignas(4) uint32_t material_type;
+        alignas(4) uint32_t two_sided;
+    };
+
+    // Per pixel working state of the wavefront kernels, for either the whole
+    // image or a single tile of it.
+    struct WavefrontBuffers {
+        gfx::ComputeBufferPtr rays;
+        gfx::ComputeBufferPtr hits;
+
+        // Material sorting state. |shading_queues| holds the counters of the
+        // counting sort and is host visible so the per queue counts can be
+        // read back, |queue_indices| holds the sorted ray indices.
+        gfx::ComputeBufferPtr shading_queues;
+        gfx::ComputeBufferPtr queue_indices;
+
+        // Visibility tests queued by the diffuse shading for next event
+        // estimation.
+        gfx::ComputeBufferPtr shadow_rays;
+    };
+
+    // Wavefront buffers come out of the buffer pools, so that resizing can
+    // reuse the previous allocations where they are still large enough.
+    WavefrontBuffers createWavefrontBuffers(uint32_t num_pixels);
+    void releaseWavefrontBuffers(WavefrontBuffers* buffers);
+
+    // Packs every mesh into a single triangle record buffer and a mesh info
+    // buffer so that the whole scene can be bound to one dispatch.
+    void buildSceneBuffers(const gfx::LogicalDevicePtr& logical_device);
+
+    // Collects the triangles of every mesh with a non-zero emissive color
+    // into the emitter list used for light sampling.
+    void buildEmitters(const gfx::LogicalDevicePtr& logical_device);
+
+    // Builds the BVHs of the meshes that are intersected through one under
+    // |bvh_mode_| and logs how long the builds took, and records the per
+    // frame rebuilds of the dynamic ones.
+    void buildMeshBVHs(const gfx::LogicalDevicePtr& logical_device);
+
+    // Builds the acceleration structure used by the ray query backend, with
+    // one instance per mesh whose custom index is the mesh's index.
+    void buildAccelerationStructure(const gfx::LogicalDevicePtr& logical_device);
+    void recordDynamicBVHBuilds(gfx::CommandBufferPtr compute_buffer);
+
+    // Writes the camera rays of the |tile_extent| sized block of the image
+    // starting at |tile_offset| for sample number |sample|.
+    void recordRayGeneration(gfx::CommandBufferPtr compute_buffer, const WavefrontBuffers& buffers,
+                             glm::uvec2 tile_offset, glm::uvec2 tile_extent, uint32_t sample,
+                             bool keep_accumulation = false);
+
+    // Times the brute force intersection kernel over the triangle records
+    // against the indexed Moller-Trumbore kernel they replaced, on the same
+    // camera rays, and logs both.
+    void benchmarkIntersection(const gfx::LogicalDevicePtr& logical_device);
+
+    // Traces sample number |sample| for each pixel of the |tile_extent| sized
+    // block of the image starting at |tile_offset|. The sample number and
+    // pixel seed all of the sample's random numbers. With |keep_accumulation|
+    // the sample's radiance is added to what the previous pass left in the
+    // rays.
+    void recordWavefront(gfx::CommandBufferPtr compute_buffer, const WavefrontBuffers& buffers,
+                         glm::uvec2 tile_offset, glm::uvec2 tile_extent, uint32_t sample,
+                         bool keep_accumulation = false);
+    void readShadingQueueCounts(uint32_t image_index);
+    void readImageError(uint32_t image_index);
+
+    // Starts the accumulation and the clock over for a new error
+    // measurement against the current reference, if there is one.
+    void restartErrorMeasurement();
+    void recordMegakernel(gfx::CommandBufferPtr compute_buffer, uint32_t image_index);
+    void recordTiled(gfx::CommandBufferPtr compute_buffer, uint32_t image_index);
+
     Camera camera_;
     std::vector<Mesh> meshes_;
+    TraceMode trace_mode_ = TraceMode::kWavefront;
+    IntersectionBackend intersection_backend_ = IntersectionBackend::kSoftware;
+    BVHMode bvh_mode_ = BVHMode::kLargeMeshes;
+
+    // Explicitly sample the emitters at every diffuse hit, combined with the
+    // BSDF samples through multiple importance sampling.
+    bool next_event_estimation_ = true;
+
+    // Draws the random numbers from an Owen scrambled Sobol sequence rather
+    // than white noise, see sampling/sampler.comp.
+    bool low_discrepancy_ = true;
+
+    // When tiled, the image is traced one fixed size tile at a time through a
+    // single tile sized set of wavefront buffers, so the working memory no
+    // longer grows with the output resolution. Large images are always
+    // tiled, smaller ones only when |force_tiled_| is set.
+    bool tiled_ = false;
+    bool force_tiled_ = false;
     gfx::RenderPassInfo render_pass_;
 
-    std::shared_ptr<christalz::ShaderResource> mwc64x_seeder_;
     std::shared_ptr<christalz::ShaderResource> ray_generator_;
     std::shared_ptr<christalz::ShaderResource> hit_tester_;
+    std::shared_ptr<christalz::ShaderResource> indexed_hit_tester_;
+    std::shared_ptr<christalz::ShaderResource> tiled_hit_tester_;
+    std::shared_ptr<christalz::ShaderResource> bvh_hit_tester_;
+    std::shared_ptr<christalz::ShaderResource> ray_query_hit_tester_;
+    std::shared_ptr<christalz::LBVHBuilder> lbvh_builder_;
     std::shared_ptr<christalz::ShaderResource> bouncer_;
+    std::shared_ptr<christalz::ShaderResource> shadow_tester_;
+    std::shared_ptr<christalz::ShaderResource> bvh_shadow_tester_;
+    std::shared_ptr<christalz::ShaderResource> ray_query_shadow_tester_;
+    std::shared_ptr<christalz::ShaderResource> shadow_resolver_;
+    std::shared_ptr<christalz::ShaderResource> material_counter_;
+    std::shared_ptr<christalz::ShaderResource> material_scanner_;
+    std::shared_ptr<christalz::ShaderResource> material_scatterer_;
+    std::shared_ptr<christalz::ShaderResource> megakernel_;
+    std::shared_ptr<christalz::ShaderResource> tile_accumulator_;
     std::shared_ptr<christalz::ShaderResource> lighter_;
     std::shared_ptr<christalz::ShaderResource> resolve_;
 
@@ -151,9 +391,58 @@ private:
 
     std::vector<vk::Semaphore> compute_semaphores_;
 
-    std::vector<gfx::ComputeBufferPtr> rays_;
-    std::vector<gfx::ComputeBufferPtr> hits_;
-    std::vector<gfx::ComputeBufferPtr> random_seeds_;
+    std::unique_ptr<christalz::BufferPool> device_buffer_pool_;
+    std::unique_ptr<christalz::BufferPool> host_buffer_pool_;
+
+    // One full resolution set per swapchain image when untiled.
+    std::vector<WavefrontBuffers> frame_buffers_;
+    std::vector<gfx::ComputeBufferPtr> work_queues_;
+    ShadingQueueCounts shading_queue_counts_ = {};
+
+    // Tiled rendering state. The tiles are accumulated straight into
+    // |tile_accum_texture_| by a compute pass instead of being splatted by
+    // the graphics queue. The tile buffers and resolve image are per
+    // swapchain image.
+    std::vector<WavefrontBuffers> tile_buffers_;
+    gfx::ComputeTexturePtr tile_accum_texture_;
+    std::vector<gfx::ComputeTexturePtr> tile_resolve_textures_;
+    bool clear_tile_accumulation_ = false;
+
+    // Time to target noise, in tiled mode. Z stores the image accumulated so
+    // far as the reference and starts over. From then on the RMSE against it
+    // is logged every time the sample count reaches a power of two, along
+    // with the time since the accumulation started. Toggling next event
+    // estimation (E) or the traversal backend (R) starts the accumulation
+    // and the clock over, so the settings can be compared by how long each
+    // takes to reach the same error. The partial sums of the squared error
+    // are read back like the shading queue counts.
+    struct ErrorMeasurement {
+        uint32_t samples = 0;
+        bool next_event_estimation = false;
+        bool ray_query = false;
+    };
+    std::shared_ptr<christalz::ShaderResource> error_meter_;
+    gfx::ComputeTexturePtr reference_texture_;
+    std::vector<gfx::ComputeBufferPtr> squared_errors_;
+    std::vector<ErrorMeasurement> error_measurements_;
+    std::chrono::steady_clock::time_point measurement_start_;
+    bool capture_reference_ = false;
+    bool has_reference_ = false;
+
+    // Whole scene, packed for the megakernel.
+    gfx::ComputeBufferPtr scene_triangles_;
+    gfx::ComputeBufferPtr scene_meshes_;
+
+    // Emitter triangles, for light sampling. |emitters_| holds a single
+    // unused entry when the scene has no emitters, since buffers can't be
+    // empty.
+    gfx::ComputeBufferPtr emitters_;
+    uint32_t num_emitters_ = 0;
+    float total_emitter_area_ = 0.f;
+
+    // Whole scene, for hardware traversal.
+    std::vector<gfx::Geometry> scene_geometries_;
+    std::shared_ptr<gfx::AccelerationStructure> scene_as_;
     std::unique_ptr<cxl::DispatchQueue> dispatch_queue_;
 };
 
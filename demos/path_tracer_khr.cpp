@@ -4,6 +4,13 @@
 
 
 #include "path_tracer_khr.hpp"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <glm/gtc/packing.hpp>
 #include <VulkanWrappers/acceleration_structure.hpp>
 #include <FileStreaming/memory_stream.hpp>
 
@@ -12,6 +19,30 @@ namespace {
 const int MAX_FRAMES_IN_FLIGHT = 2;
 int sample = 1;
 
+// Adaptive sampling rebuilds its list of unconverged pixels every this many
+// frames. A pixel has converged once it has at least kAdaptiveMinSamples
+// samples and the standard error of its mean luminance is below
+// kAdaptiveMaxRelativeError of the mean.
+const uint32_t kAdaptiveInterval = 8;
+const uint32_t kAdaptiveMinSamples = 32;
+const float kAdaptiveMaxRelativeError = 0.01f;
+
+// Workgroup size of image_error.comp, each of which writes one partial sum.
+const uint32_t kErrorWorkgroupSize = 256;
+
+// Size of a reservoir in restir.comp, see types/reservoir.comp.
+const uint32_t kReservoirSize = 32;
+
+// The guiding tree trains for kGuidingIterations iterations, the first
+// kGuidingFirstIterationFrames frames long and every next one twice as long
+// as the one before. Every frame writes at most kGuidingRecordCapacity
+// records, spread over the image by recording paths at random, about
+// kGuidingVerticesPerPath records each.
+const uint32_t kGuidingIterations = 8;
+const uint32_t kGuidingFirstIterationFrames = 4;
+const uint32_t kGuidingRecordCapacity = 1 << 16;
+const uint32_t kGuidingVerticesPerPath = 4;
+
 std::shared_ptr<gfx::ShaderModule> getModule(gfx::LogicalDevicePtr device, 
                                              const std::string& program_name,
                                              vk::ShaderStageFlagBits stage) {
@@ -68,6 +99,120 @@ void readObjFile(const std::string& filename, std::vector<float>& positions, std
     file.close();
 }
 
+// Calls |function| on every index in [0, count), split into contiguous
+// ranges over the available hardware threads.
+template <typename Function>
+void parallelFor(size_t count, Function function) {
+    const size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t chunk = (count + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (size_t start = 0; start < count; start += chunk) {
+        size_t end = std::min(count, start + chunk);
+        threads.emplace_back([start, end, &function] {
+            for (size_t i = start; i < end; i++) {
+                function(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Octahedral encoding of a unit normal into two 16 bit snorms. Must match
+// encodeNormal in types/intersection.comp.
+uint32_t encodeNormal(glm::vec3 normal) {
+    normal /= std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    glm::vec2 encoded(normal.x, normal.y);
+    if (normal.z < 0.f) {
+        encoded = (1.f - glm::abs(glm::vec2(normal.y, normal.x))) *
+                  glm::vec2(normal.x >= 0.f ? 1.f : -1.f, normal.y >= 0.f ? 1.f : -1.f);
+    }
+    return glm::packSnorm2x16(encoded);
+}
+
+// Inverse of encodeNormal(). Must match decodeNormal in
+// types/intersection.comp.
+glm::vec3 decodeNormal(uint32_t packed_normal) {
+    glm::vec2 encoded = glm::unpackSnorm2x16(packed_normal);
+    glm::vec3 normal(encoded, 1.f - std::abs(encoded.x) - std::abs(encoded.y));
+    float fold = std::max(-normal.z, 0.f);
+    normal.x += normal.x >= 0.f ? -fold : fold;
+    normal.y += normal.y >= 0.f ? -fold : fold;
+    return glm::normalize(normal);
+}
+
+// Builds the per triangle normal records read by the hit shader. Each
+// holds the encoded smooth normals of the triangle's three vertices in
+// xyz and its face normal in w. Vertex normals are the area weighted
+// average of the normals of the faces around them.
+std::vector<glm::uvec4> computeTriangleNormals(const std::vector<float>& positions,
+                                               const std::vector<uint32_t>& indices) {
+    const size_t num_vertices = positions.size() / 3;
+    const size_t num_triangles = indices.size() / 3;
+    auto vertex = [&positions](uint32_t index) {
+        return glm::vec3(positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+    };
+
+    // Unnormalized, so that larger faces weigh more.
+    std::vector<glm::vec3> face_normals(num_triangles);
+    parallelFor(num_triangles, [&](size_t i) {
+        glm::vec3 v0 = vertex(indices[3 * i]);
+        glm::vec3 v1 = vertex(indices[3 * i + 1]);
+        glm::vec3 v2 = vertex(indices[3 * i + 2]);
+        face_normals[i] = glm::cross(v0 - v1, v0 - v2);
+    });
+
+    // Triangles around every vertex, so vertices can be summed in parallel
+    // without contending over shared sums.
+    std::vector<uint32_t> vertex_starts(num_vertices + 1, 0);
+    for (auto index : indices) {
+        vertex_starts[index + 1]++;
+    }
+    for (size_t i = 0; i < num_vertices; i++) {
+        vertex_starts[i + 1] += vertex_starts[i];
+    }
+    std::vector<uint32_t> vertex_triangles(indices.size());
+    std::vector<uint32_t> fill = vertex_starts;
+    for (size_t i = 0; i < indices.size(); i++) {
+        vertex_triangles[fill[indices[i]]++] = i / 3;
+    }
+
+    std::vector<glm::vec3> vertex_normals(num_vertices);
+    parallelFor(num_vertices, [&](size_t v) {
+        glm::vec3 sum(0.f);
+        for (uint32_t i = vertex_starts[v]; i < vertex_starts[v + 1]; i++) {
+            sum += face_normals[vertex_triangles[i]];
+        }
+        vertex_normals[v] = sum;
+    });
+
+    std::vector<glm::uvec4> records(num_triangles);
+    parallelFor(num_triangles, [&](size_t i) {
+        // Degenerate faces have no direction, fall back to straight up
+        // rather than encoding NaNs.
+        glm::vec3 face = glm::length(face_normals[i]) > 0.f ? glm::normalize(face_normals[i]) : glm::vec3(0, 1, 0);
+        glm::uvec4 record;
+        for (uint32_t k = 0; k < 3; k++) {
+            glm::vec3 normal = vertex_normals[indices[3 * i + k]];
+            record[k] = encodeNormal(glm::length(normal) > 0.f ? glm::normalize(normal) : face);
+        }
+        record.w = encodeNormal(face);
+        records[i] = record;
+    });
+    return records;
+}
+
+// Places a Lucy model, which is modeled facing away from the camera, at
+// |translation|.
+glm::mat4 lucyTransform(glm::vec3 translation) {
+    glm::vec3 scaleFactors(210.0f, 210.f, 210.f);
+    glm::mat4 scaleMatrix = glm::scale(glm::mat4(1.0f), scaleFactors);
+    glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), translation);
+    glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    return translationMatrix * rotationMatrix * scaleMatrix;
+}
+
 } // anonymous namespace
 
 static uint64_t identifier = 1;
@@ -87,11 +232,8 @@ gfx::Geometry PathTracerKHR::createBBox(const gfx::LogicalDevicePtr& logical_dev
 
 	std::vector<VkAabbPositionsKHR> aabbs = {bbox};
 	bbox_geom.bbox = gfx::ComputeBuffer::createFromVector(logical_device, aabbs, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR);
-    as_->addGeometry(bbox_geom);
 
-    auto mat_buf = gfx::ComputeBuffer::createHostAccessableBuffer(logical_device, sizeof(Material), vk::BufferUsageFlagBits::eShaderDeviceAddress);
-    mat_buf->write(&material, 1);
-    materials_map_[bbox_geom.identifier] = mat_buf;
+    shading_data_.emplace(bbox_geom.identifier, ShadingData{{}, material});
     return bbox_geom;
 }
 
@@ -100,39 +242,177 @@ gfx::Geometry PathTracerKHR::createGeometry(const gfx::LogicalDevicePtr& logical
                             const std::vector<uint32_t>& indices,
                             const Material& material) {
     gfx::Geometry geometry; 
-    vk::BufferUsageFlags flags = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
-    geometry.positions = gfx::ComputeBuffer::createFromVector(logical_device, positions, flags);
-    geometry.indices = gfx::ComputeBuffer::createFromVector(logical_device, indices, flags);
     geometry.num_indices = indices.size();
     geometry.num_vertices = positions.size() / 3;
     geometry.identifier = identifier++;
-    as_->addGeometry(geometry);
 
-    auto mat_buf = gfx::ComputeBuffer::createHostAccessableBuffer(logical_device, sizeof(Material), vk::BufferUsageFlagBits::eShaderDeviceAddress);
-    mat_buf->write(&material, 1);
-    materials_map_[geometry.identifier] = mat_buf;
+    for (size_t i = 0; i < positions.size(); i += 3) {
+        glm::vec3 position(positions[i], positions[i + 1], positions[i + 2]);
+        bounds_min_ = glm::min(bounds_min_, position);
+        bounds_max_ = glm::max(bounds_max_, position);
+    }
+
+    shading_data_.emplace(geometry.identifier, ShadingData{computeTriangleNormals(positions, indices), material});
+
+    // The uploads submit, so only they need the queue lock.
+    std::lock_guard<std::mutex> lock(*queue_mutex_);
+    vk::BufferUsageFlags flags = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+    geometry.positions = gfx::ComputeBuffer::createFromVector(logical_device, positions, flags);
+    geometry.indices = gfx::ComputeBuffer::createFromVector(logical_device, indices, flags);
     return geometry;
 }
 
+PathTracerKHR::Scene PathTracerKHR::buildScene(const gfx::LogicalDevicePtr& logical_device,
+                                               const std::vector<gfx::Geometry>& scene_geometries,
+                                               const gfx::GeomInstance& sphere,
+                                               const gfx::GeomInstance& lucy2) {
+    Scene scene;
+    scene.as = std::make_shared<gfx::AccelerationStructure>(logical_device);
+    for (const auto& geometry : scene_geometries) {
+        scene.as->addGeometry(geometry);
+    }
+
+    // Every mesh gets an instance of its own, Lucy gets a second one and the
+    // sphere goes last.
+    std::vector<gfx::GeomInstance> instances;
+    for (const auto& geometry : scene_geometries) {
+        if (geometry.identifier == sphere.geometryID) {
+            continue;
+        }
+        gfx::GeomInstance instance;
+        instance.identifier = geometry.identifier;
+        instance.geometryID = geometry.identifier;
+        if (geometry.identifier == lucy2.geometryID) {
+            instance.world_transform = lucyTransform(glm::vec3(410, 0, 250));
+            instances.push_back(instance);
+            instances.push_back(lucy2);
+        } else {
+            instances.push_back(instance);
+        }
+    }
+    instances.push_back(sphere);
+
+    // Pack every geometry's shading data into the arenas once, no matter how
+    // many instances it has.
+    std::vector<glm::uvec4> triangle_normals;
+    std::vector<Material> materials;
+    std::map<uint64_t, ObjDesc> geometry_descs;
+    for (const auto& geometry : scene_geometries) {
+        const auto& data = shading_data_.at(geometry.identifier);
+        ObjDesc desc;
+        desc.triangle_offset = triangle_normals.size();
+        desc.material_index = materials.size();
+        triangle_normals.insert(triangle_normals.end(), data.triangle_normals.begin(), data.triangle_normals.end());
+        materials.push_back(data.material);
+        geometry_descs[geometry.identifier] = desc;
+    }
+
+    std::vector<ObjDesc> obj_descs;
+    uint32_t k = 0;
+    for (auto& instance : instances) {
+        obj_descs.push_back(geometry_descs.at(instance.geometryID));
+        instance.custom_index = k;
+        k++;
+    }
+
+    // Only the sphere can leave the triangle arena empty, but buffers can't
+    // be empty.
+    if (triangle_normals.empty()) {
+        triangle_normals.resize(1, glm::uvec4(0));
+    }
+
+    std::lock_guard<std::mutex> lock(*queue_mutex_);
+    scene.obj_descriptions = gfx::ComputeBuffer::createFromVector(logical_device, obj_descs, vk::BufferUsageFlagBits::eStorageBuffer);
+    scene.triangle_normals = gfx::ComputeBuffer::createFromVector(logical_device, triangle_normals, vk::BufferUsageFlagBits::eStorageBuffer);
+    scene.materials = gfx::ComputeBuffer::createFromVector(logical_device, materials, vk::BufferUsageFlagBits::eStorageBuffer);
+    scene.as->build(instances);
+    return scene;
+}
+
+void PathTracerKHR::streamLucy(const gfx::LogicalDevicePtr& logical_device) {
+    gfx::GeomInstance sphere = sphere_;
+    gfx::GeomInstance lucy2 = lucy2_;
+    pending_scene_ = std::async(std::launch::async, [this, logical_device, sphere, lucy2]() mutable {
+        std::vector<float> lucy_pos;
+        std::vector<uint32_t> lucy_indices;
+        readObjFile("lucy_resized.obj", lucy_pos, lucy_indices);
+
+        // createGeometry() and buildScene() take the queue lock around their
+        // submissions only, the normals and arenas are built without it.
+        geometries.push_back(createGeometry(logical_device, lucy_pos, lucy_indices, Material(glm::vec4(0.8))));
+        lucy2.geometryID = geometries.back().identifier;
+        Scene scene = buildScene(logical_device, geometries, sphere, lucy2);
+        CXL_LOG(INFO) << "Streamed in " << lucy_indices.size() / 3 << " Lucy triangles";
+        return scene;
+    });
+}
+
+void PathTracerKHR::swapInStreamedScene() {
+    if (!pending_scene_.valid() ||
+        pending_scene_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        // Decrement the countdown of the structure retired by the last swap,
+        // frames recorded before the swap may still be tracing it.
+        if (retired_frames_left_ > 0 && --retired_frames_left_ == 0) {
+            retired_scene_ = Scene();
+        }
+        return;
+    }
+
+    retired_scene_ = scene_;
+    retired_frames_left_ = num_swap_images_ + MAX_FRAMES_IN_FLIGHT;
+
+    scene_ = pending_scene_.get();
+    lucy_streamed_ = true;
+    has_reference_ = false;
+    resetPathGuiding();
+
+    // The new structure was built with the transforms from when the build
+    // started, so hand it the latest ones.
+    pending_transforms_[sphere_.identifier] = sphere_.world_transform;
+    pending_transforms_[lucy2_.identifier] = lucy2_.world_transform;
+    clear_image_ = true;
+}
+
 void PathTracerKHR::setup(gfx::LogicalDevicePtr logical_device, int32_t num_swap, int32_t width, int32_t height) {
     CXL_DCHECK(logical_device);
-    logical_device_ = logical_device;
-    num_swap_images_ = num_swap;
-    width_ = width;
-    height_ = height;
 
-    compute_command_buffers_ = gfx::CommandBuffer::create(logical_device, gfx::Queue::Type::kCompute,
-                                                          vk::CommandBufferLevel::ePrimary, num_swap);
+    // The harness calls setup() again every time the swapchain is recreated.
+    // The scene, the shaders and the guiding tree don't depend on the
+    // swapchain, and Lucy must only be streamed in once, so only the
+    // swapchain dependent state is rebuilt.
+    const bool initialized = logical_device_.lock() == logical_device;
+    logical_device_ = logical_device;
 
-    accum_textures_[0] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
-    accum_textures_[1] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    if (!initialized || num_swap_images_ != num_swap) {
+        compute_command_buffers_ = gfx::CommandBuffer::create(logical_device, gfx::Queue::Type::kCompute,
+                                                              vk::CommandBufferLevel::ePrimary, num_swap);
+    }
+    num_swap_images_ = num_swap;
 
-    resolve_texture_ = gfx::ImageUtils::createStorageImage(logical_device, width,
-                                                           height, vk::SampleCountFlagBits::e1);
-    CXL_DCHECK(resolve_texture_);
+    if (initialized) {
+        resize(width, height);
+        return;
+    }
 
     compute_semaphores_ = logical_device->createSemaphores(MAX_FRAMES_IN_FLIGHT);
 
+    cxl::FileSystem fs(cxl::FileSystem::currentExecutablePath() + "/resources/spirv");
+    reprojector_ = christalz::ShaderResource::createCompute(logical_device, fs, "reproject");
+    CXL_DCHECK(reprojector_);
+    denoiser_ = christalz::ATrousDenoiser::create(logical_device, fs);
+    CXL_DCHECK(denoiser_);
+    adaptive_mask_ = christalz::ShaderResource::createCompute(logical_device, fs, "adaptive_mask");
+    CXL_DCHECK(adaptive_mask_);
+    error_meter_ = christalz::ShaderResource::createCompute(logical_device, fs, "image_error");
+    CXL_DCHECK(error_meter_);
+    if (ray_query_supported_) {
+        restir_ = christalz::ShaderResource::createCompute(logical_device, fs, "restir");
+        CXL_DCHECK(restir_);
+    } else {
+        direct_light_resampling_ = false;
+    }
+
+    resize(width, height);
 
     shader_manager_ = std::make_shared<gfx::RayTracingShaderManager>(logical_device);
     CXL_DCHECK(shader_manager_);
@@ -158,7 +438,7 @@ void PathTracerKHR::setup(gfx::LogicalDevicePtr logical_device, int32_t num_swap
     auto sphere_hit_group = shader_manager_->create_hit_group(/*any*/10000, sphere_closest_id, sphere_intersect_id);
 
     shader_manager_->build();
-    as_ = std::make_shared<gfx::AccelerationStructure>(logical_device);
+    sphere_.shaderTableOffset = shader_manager_->index_for_hit_group(sphere_hit_group);
 
     // Camera
     camera_.sensor_width = 0.025;
@@ -227,47 +507,6 @@ void PathTracerKHR::setup(gfx::LogicalDevicePtr logical_device, int32_t num_swap
                         {0,1,2,0,2,3}, 
                         Material(glm::vec4(0.9, 0.9, 0.9, 1.0))));
 
-    std::vector<float> bunny_pos;
-    std::vector<uint32_t> bunny_indices;
-    readObjFile("lucy_resized.obj", bunny_pos, bunny_indices);
-    geometries.push_back(createGeometry(logical_device, bunny_pos, bunny_indices, Material(glm::vec4(0.8))));
-
-    std::vector<gfx::GeomInstance> instances;
-    for (uint32_t i = 1; i <= geometries.size(); i++) {
-        gfx::GeomInstance instance;
-        instance.identifier = i;
-        instance.geometryID = i;
-        instances.push_back(instance);
-    }
-
-    // Duplicate lucy
-    lucy2_.identifier = geometries.size();
-    lucy2_.geometryID = geometries.size();
-    instances.push_back(lucy2_);
-
- //   Bunny params
- //   glm::vec3 scaleFactors(2000.0f, 2000.f, 2000.f);
- //   glm::vec3 translation(250, -80, 300);
-    // Lucy params
-    {
-        glm::vec3 scaleFactors(210.0f, 210.f, 210.f);
-        glm::vec3 translation(410, 0, 250);
-        glm::mat4 scaleMatrix = glm::scale(glm::mat4(1.0f), scaleFactors);
-        glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), translation);
-        glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        glm::mat4 finalMatrix = translationMatrix * rotationMatrix * scaleMatrix;
-        instances[instances.size()-2].world_transform = finalMatrix;
-    }
-    {
-        glm::vec3 scaleFactors(210.0f, 210.f, 210.f);
-        glm::vec3 translation(160, 0, 320);
-        glm::mat4 scaleMatrix = glm::scale(glm::mat4(1.0f), scaleFactors);
-        glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), translation);
-        glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        glm::mat4 finalMatrix = translationMatrix * rotationMatrix * scaleMatrix;
-        instances[instances.size()-1].world_transform = finalMatrix;
-    }
-
     // Create sphere.
     geometries.push_back(createBBox(logical_device, Material(glm::vec4(0), glm::vec4(50))));
     {
@@ -279,86 +518,112 @@ void PathTracerKHR::setup(gfx::LogicalDevicePtr logical_device, int32_t num_swap
         glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), translation);
         glm::mat4 finalMatrix = translationMatrix * scaleMatrix;
         sphere_.world_transform = finalMatrix;
-        sphere_.shaderTableOffset = shader_manager_->index_for_hit_group(sphere_hit_group);
-        instances.push_back(sphere_);
+        light_radiance_ = glm::vec3(shading_data_.at(sphere_.geometryID).material.emissive_color);
     }
 
-    std::vector<ObjDesc> obj_descs;
-    uint32_t k = 0;
-    for (auto& instance : instances) {
-        ObjDesc desc;
-        desc.materialAddress = materials_map_[instance.geometryID]->device_address();
-        auto geometry = geometries[instance.geometryID-1];
-        if (geometry.type == gfx::GeometryType::eTriangles) {
-            desc.indexAddress = geometries[instance.geometryID-1].indices->device_address();
-            desc.vertexAddress = geometries[instance.geometryID-1].positions->device_address();
-        }
-        instance.custom_index = k;
-        obj_descs.push_back(desc);
-        k++;
-    }         
+    // Lucy stands inside the room, so its bounds are the whole scene's. They
+    // are padded a little so that positions on the walls fall inside.
+    const glm::vec3 padding = 0.01f * (bounds_max_ - bounds_min_);
+    guiding_tree_ = std::make_unique<christalz::SDTree>(bounds_min_ - padding, bounds_max_ + padding);
+
+    // The room is only a handful of triangles, so it is built right away and
+    // rendering can start while the Lucy models stream in.
+    scene_ = buildScene(logical_device, geometries, sphere_, lucy2_);
+    CXL_DCHECK(scene_.as);
+
+    // Lucy is large enough that loading it and building its structure would
+    // hold up the first frame for a while, so it is streamed in instead.
+    lucy2_.identifier = 9998;
+    lucy2_.world_transform = lucyTransform(glm::vec3(160, 0, 320));
+    streamLucy(logical_device);
+    CXL_LOG(INFO) << "Finished setup!";
+}
 
-    obj_descriptions_ = gfx::ComputeBuffer::createFromVector(logical_device, obj_descs, vk::BufferUsageFlagBits::eStorageBuffer);
+void PathTracerKHR::resize(uint32_t width, uint32_t height) {
+    auto logical_device = logical_device_.lock();
+    CXL_DCHECK(logical_device);
+    width_ = width;
+    height_ = height;
+    const uint32_t num_swap = num_swap_images_;
 
-    as_->build(instances);
-    CXL_DCHECK(as_);
+    accum_textures_[0] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    accum_textures_[1] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    position_textures_[0] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    position_textures_[1] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    moment_textures_[0] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    moment_textures_[1] = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    normal_depth_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    albedo_texture_ = gfx::ImageUtils::createStorageImage(logical_device, width, height, vk::SampleCountFlagBits::e1);
+    CXL_DCHECK(normal_depth_texture_ && albedo_texture_);
 
-    // Random seeds
-    cxl::FileSystem fs(cxl::FileSystem::currentExecutablePath() + "/resources/spirv");
-    mwc64x_seeder_ = christalz::ShaderResource::createCompute(logical_device, fs, "mwc64x_seeding");
-    CXL_DCHECK(mwc64x_seeder_);
-    for (uint32_t i = 0; i < num_swap_images_; i++) {
-        random_seeds_.push_back(gfx::ComputeBuffer::createStorageBuffer(logical_device, sizeof(uint32_t) * width_ * height_ * 2));
-    }
+    resolve_texture_ = gfx::ImageUtils::createStorageImage(logical_device, width,
+                                                           height, vk::SampleCountFlagBits::e1);
+    CXL_DCHECK(resolve_texture_);
 
-    auto compute_buffer = compute_command_buffers_[0];
-    compute_buffer->reset();
-    compute_buffer->beginRecording();
+    denoiser_->resize(width, height);
 
-    uint64_t offset = 0;
-    for (uint32_t i = 0; i < num_swap_images_; i++) {
-        compute_buffer->setProgram(mwc64x_seeder_->program());
-        compute_buffer->bindUniformBuffer(0, 0, random_seeds_[i]);
-        compute_buffer->pushConstants(offset);
-        compute_buffer->dispatch(width_ * height_/ 16, 1, 1);
-        offset += width_ * height_;
+    // The list starts with its count, followed by a packed pixel each.
+    active_pixels_ = gfx::ComputeBuffer::createStorageBuffer(logical_device, sizeof(uint32_t) * (width * height + 1));
+    active_pixel_counts_.clear();
+    for (uint32_t i = 0; i < num_swap; i++) {
+        active_pixel_counts_.push_back(gfx::ComputeBuffer::createHostAccessableBuffer(
+            logical_device, sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer));
     }
+    counted_generations_.assign(num_swap, 0);
+
+    reference_texture_ = gfx::ImageUtils::createAccumulationAttachment(logical_device, width, height, vk::ImageUsageFlagBits::eStorage, vk::ImageLayout::eGeneral);
+    const uint32_t num_error_workgroups = (width * height + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize;
+    squared_errors_.clear();
+    for (uint32_t i = 0; i < num_swap; i++) {
+        squared_errors_.push_back(gfx::ComputeBuffer::createHostAccessableBuffer(
+            logical_device, sizeof(float) * num_error_workgroups, vk::BufferUsageFlagBits::eStorageBuffer));
+    }
+    error_measurements_.assign(num_swap, ErrorMeasurement());
 
-    compute_buffer->endRecording();
-    logical_device->getQueue(gfx::Queue::Type::kCompute).submit(compute_buffer);
-    logical_device->waitIdle();
-    CXL_LOG(INFO) << "Finished setup!";
-}
+    if (ray_query_supported_) {
+        reservoirs_[0] = gfx::ComputeBuffer::createStorageBuffer(logical_device, kReservoirSize * width * height);
+        reservoirs_[1] = gfx::ComputeBuffer::createStorageBuffer(logical_device, kReservoirSize * width * height);
+    }
 
-void PathTracerKHR::resize(uint32_t width, uint32_t height) {
+    guiding_records_.clear();
+    for (uint32_t i = 0; i < num_swap; i++) {
+        guiding_records_.push_back(gfx::ComputeBuffer::createHostAccessableBuffer(
+            logical_device, sizeof(glm::uvec4) * (kGuidingRecordCapacity + 1), vk::BufferUsageFlagBits::eStorageBuffer));
+    }
+    has_guiding_records_.assign(num_swap, false);
+
+    // The new images start out without any history to reuse.
+    active_launch_size_ = width * height;
+    traced_pixels_ = width * height;
+    has_active_pixels_ = false;
+    has_rendered_ = false;
+    has_reference_ = false;
+    clear_image_ = true;
 }
 
 void PathTracerKHR::processEvent(display::InputEvent event) {
+    // Camera moves keep whatever accumulated samples are still visible, see
+    // renderFrame(). Moving instances changes the lighting everywhere, so
+    // those still start over.
     if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::I) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(0,0,1));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::K) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(0,0,-1));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::J) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(1,0,0));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::L) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(-1,0,0));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::O) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(0,1,0));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::P) {
         camera_.matrix = glm::translate(camera_.matrix, glm::vec3(0,-1,0));
-        clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::Y) {
         sphere_.world_transform = glm::translate(sphere_.world_transform, glm::vec3(0,1.0/30.0,0));
-        as_->set_matrix(sphere_.identifier, sphere_.world_transform);
+        pending_transforms_[sphere_.identifier] = sphere_.world_transform;
         clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::H) {
         sphere_.world_transform = glm::translate(sphere_.world_transform, glm::vec3(0,-1.0/30.0,0));
-        as_->set_matrix(sphere_.identifier, sphere_.world_transform);
+        pending_transforms_[sphere_.identifier] = sphere_.world_transform;
         clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::V) {
         glm::vec3 scaleFactors(210.0f, 210.f, 210.f);
@@ -369,7 +634,7 @@ void PathTracerKHR::processEvent(display::InputEvent event) {
         glm::mat4 finalMatrix = translationMatrix * rotationMatrix * scaleMatrix;
             
         lucy2_.world_transform = finalMatrix;
-        as_->set_matrix(lucy2_.identifier, lucy2_.world_transform);
+        pending_transforms_[lucy2_.identifier] = lucy2_.world_transform;
         clear_image_ = true;
     } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::B) {
         glm::vec3 scaleFactors(210.0f, 210.f, 210.f);
@@ -380,11 +645,169 @@ void PathTracerKHR::processEvent(display::InputEvent event) {
         glm::mat4 finalMatrix = translationMatrix * rotationMatrix * scaleMatrix;
         
         lucy2_.world_transform = finalMatrix;
-        as_->set_matrix(lucy2_.identifier, lucy2_.world_transform);
+        pending_transforms_[lucy2_.identifier] = lucy2_.world_transform;
+        clear_image_ = true;
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::F) {
+        // Only changes how the accumulation is displayed, so nothing is lost.
+        denoise_ = !denoise_;
+        CXL_LOG(INFO) << "PathTracerKHR denoiser: " << (denoise_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::G) {
+        // Only changes where the next samples go. Turning it back on starts
+        // from a freshly built list.
+        adaptive_ = !adaptive_;
+        has_active_pixels_ = false;
+        CXL_LOG(INFO) << "PathTracerKHR adaptive sampling: " << (adaptive_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::X) {
+        // Starts over so that the error of each sampler can be followed from
+        // the first sample.
+        low_discrepancy_ = !low_discrepancy_;
+        clear_image_ = true;
+        CXL_LOG(INFO) << "PathTracerKHR sampler: " << (low_discrepancy_ ? "sobol" : "white noise");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::C) {
+        if (!ray_query_supported_) {
+            CXL_LOG(INFO) << "PathTracerKHR direct light resampling unavailable: device lacks VK_KHR_ray_query";
+            return;
+        }
+        // The two ways of lighting the primary hits converge to the same
+        // image but mixing their samples would hide the difference.
+        direct_light_resampling_ = !direct_light_resampling_;
         clear_image_ = true;
+        CXL_LOG(INFO) << "PathTracerKHR direct light resampling: " << (direct_light_resampling_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::U) {
+        // Training carries on either way, only sampling from the tree is
+        // switched.
+        path_guiding_ = !path_guiding_;
+        guiding_dirty_ = true;
+        clear_image_ = true;
+        CXL_LOG(INFO) << "PathTracerKHR path guiding: " << (path_guiding_ ? "on" : "off");
+    } else if (event.type == display::InputEventType::KeyPressed && event.key == display::KeyCode::Z) {
+        capture_reference_ = true;
     }
 };
 
+void PathTracerKHR::applyPendingTransforms() {
+    // Several key presses can move instances between two frames, so only the
+    // latest transform of every moved instance is kept. Every set_matrix()
+    // rebuilds the top level structure, so a single instance is handed over
+    // per frame and any others stay pending for the following frames. Lucy's
+    // duplicate keeps its transform pending until it has been streamed in.
+    for (auto it = pending_transforms_.begin(); it != pending_transforms_.end(); ++it) {
+        if (it->first == lucy2_.identifier && !lucy_streamed_) {
+            continue;
+        }
+        scene_.as->set_matrix(it->first, it->second);
+        clear_image_ = true;
+        has_reference_ = false;
+        resetPathGuiding();
+        pending_transforms_.erase(it);
+        return;
+    }
+}
+
+void PathTracerKHR::readActivePixelCount(uint32_t image_index) {
+    // The command buffer for |image_index| has finished executing by the time
+    // it is reset for reuse, so the count it wrote is safe to read. Counts
+    // from a list that has since been replaced are ignored.
+    if (counted_generations_[image_index] == 0 || counted_generations_[image_index] != mask_generation_) {
+        return;
+    }
+    auto count = static_cast<const uint32_t*>(active_pixel_counts_[image_index]->map());
+    active_launch_size_ = *count;
+    active_pixel_counts_[image_index]->unmap();
+    counted_generations_[image_index] = 0;
+}
+
+void PathTracerKHR::readImageError(uint32_t image_index) {
+    ErrorMeasurement& measurement = error_measurements_[image_index];
+    if (measurement.samples == 0) {
+        return;
+    }
+
+    const uint32_t num_workgroups = (width_ * height_ + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize;
+    auto squared_errors = static_cast<const float*>(squared_errors_[image_index]->map());
+    double sum = 0.0;
+    for (uint32_t i = 0; i < num_workgroups; i++) {
+        sum += squared_errors[i];
+    }
+    squared_errors_[image_index]->unmap();
+
+    double rmse = std::sqrt(sum / (3.0 * width_ * height_));
+    CXL_LOG(INFO) << "PathTracerKHR " << (measurement.low_discrepancy ? "sobol" : "white noise")
+                  << " rmse at " << measurement.samples << " spp: " << rmse;
+    measurement.samples = 0;
+}
+
+void PathTracerKHR::resetPathGuiding() {
+    guiding_tree_->reset();
+    guiding_frames_ = 0;
+    guiding_dirty_ = true;
+    // Records still in flight were taken in the old scene.
+    std::fill(has_guiding_records_.begin(), has_guiding_records_.end(), false);
+}
+
+void PathTracerKHR::updatePathGuiding(uint32_t image_index) {
+    auto logical_device = logical_device_.lock();
+    CXL_DCHECK(logical_device);
+
+    for (auto it = retired_guiding_buffers_.begin(); it != retired_guiding_buffers_.end();) {
+        if (--it->second == 0) {
+            it = retired_guiding_buffers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (has_guiding_records_[image_index]) {
+        auto words = static_cast<const glm::uvec4*>(guiding_records_[image_index]->map());
+        const uint32_t count = std::min(words[0].x, kGuidingRecordCapacity);
+        for (uint32_t i = 0; i < count; i++) {
+            const glm::uvec4& record = words[i + 1];
+            glm::vec3 position(glm::unpackHalf2x16(record.x), glm::unpackHalf2x16(record.y).x);
+            guiding_tree_->record(position, decodeNormal(record.z), glm::uintBitsToFloat(record.w));
+        }
+        guiding_records_[image_index]->unmap();
+        has_guiding_records_[image_index] = false;
+    }
+
+    const uint32_t iteration = guiding_tree_->iteration();
+    if (iteration < kGuidingIterations && guiding_frames_ >= kGuidingFirstIterationFrames << iteration) {
+        guiding_tree_->refine();
+        guiding_frames_ = 0;
+        guiding_dirty_ = true;
+        CXL_LOG(INFO) << "PathTracerKHR finished guiding iteration " << iteration;
+    }
+
+    if (!guiding_dirty_) {
+        return;
+    }
+    christalz::SDTree::Header header;
+    std::vector<christalz::SDTree::SpatialNode> spatial_nodes;
+    std::vector<christalz::SDTree::DirectionalNode> directional_nodes;
+    guiding_tree_->flatten(&header, &spatial_nodes, &directional_nodes);
+    if (!path_guiding_) {
+        header.ready = 0;
+    }
+
+    // The header goes in front of the spatial nodes.
+    std::vector<uint8_t> spatial_data(sizeof(header) + sizeof(spatial_nodes[0]) * spatial_nodes.size());
+    std::memcpy(spatial_data.data(), &header, sizeof(header));
+    std::memcpy(spatial_data.data() + sizeof(header), spatial_nodes.data(), sizeof(spatial_nodes[0]) * spatial_nodes.size());
+
+    retired_guiding_buffers_.push_back({guiding_buffers_, uint32_t(num_swap_images_ + MAX_FRAMES_IN_FLIGHT)});
+    guiding_buffers_.spatial_nodes = gfx::ComputeBuffer::createHostAccessableBuffer(
+        logical_device, spatial_data.size(), vk::BufferUsageFlagBits::eStorageBuffer);
+    guiding_buffers_.spatial_nodes->write(spatial_data.data(), spatial_data.size());
+    guiding_buffers_.directional_nodes = gfx::ComputeBuffer::createHostAccessableBuffer(
+        logical_device, sizeof(directional_nodes[0]) * directional_nodes.size(), vk::BufferUsageFlagBits::eStorageBuffer);
+    guiding_buffers_.directional_nodes->write(directional_nodes.data(), directional_nodes.size());
+    guiding_dirty_ = false;
+}
+
+std::string PathTracerKHR::statusText() {
+    uint32_t percent = (100 * traced_pixels_ + width_ * height_ / 2) / (width_ * height_);
+    return "active pixels: " + std::to_string(percent) + "%";
+}
+
 gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
                 gfx::CommandBufferPtr command_buffer, 
                 uint32_t image_index, 
@@ -397,12 +820,42 @@ gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
     auto compute_buffer = compute_command_buffers_[image_index];
     CXL_DCHECK(compute_buffer);
 
+    swapInStreamedScene();
+    applyPendingTransforms();
+    readActivePixelCount(image_index);
+    readImageError(image_index);
+    updatePathGuiding(image_index);
+
     compute_buffer->reset();
     compute_buffer->beginRecording();
 
+    // The reference is whatever has accumulated up to this frame, after
+    // which the accumulation starts over to be measured against it.
+    if (capture_reference_) {
+        uint32_t stage = 0;
+        compute_buffer->setProgram(error_meter_->program());
+        compute_buffer->bindStorageImage(0, 0, accum_textures_[texture_index]);
+        compute_buffer->bindStorageImage(0, 1, reference_texture_);
+        compute_buffer->bindUniformBuffer(0, 2, squared_errors_[image_index]);
+        compute_buffer->pushConstants(width_);
+        compute_buffer->pushConstants(height_, 4u);
+        compute_buffer->pushConstants(stage, 8u);
+        compute_buffer->dispatch((width_ * height_ + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize, 1, 1);
+        capture_reference_ = false;
+        has_reference_ = true;
+        reference_camera_matrix_ = camera_.matrix;
+        clear_image_ = true;
+        CXL_LOG(INFO) << "PathTracerKHR captured the reference at " << sample_ - 1 << " spp";
+    }
+
+    // The clears go on the compute queue with the rest of the frame, so
+    // that this frame's tracing and error measurement already see them.
+    const bool reset_history = clear_image_;
     if (clear_image_) {
-        command_buffer->clearColorImage(accum_textures_[0], {0,0,0,0});
-        command_buffer->clearColorImage(accum_textures_[1], {0,0,0,0});
+        compute_buffer->clearColorImage(accum_textures_[0], {0,0,0,0});
+        compute_buffer->clearColorImage(accum_textures_[1], {0,0,0,0});
+        compute_buffer->clearColorImage(moment_textures_[0], {0,0,0,0});
+        compute_buffer->clearColorImage(moment_textures_[1], {0,0,0,0});
         clear_image_ = false;
         sample_ = 1;
     }
@@ -410,16 +863,53 @@ gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
     resolve_texture_->transitionImageLayout(*compute_buffer.get(), vk::ImageLayout::eGeneral);
 
     compute_buffer->setProgram(shader_manager_);
-    compute_buffer->setRecursiveDepth(3);
+    // Paths are traced iteratively from the raygen shader and the hit
+    // shaders never trace rays of their own, so the stack only ever needs
+    // room for one level. The stack size itself is the driver's default for
+    // that depth, RayTracingShaderManager exposes neither the per group
+    // stack size queries nor the dynamic stack size state.
+    compute_buffer->setRecursiveDepth(1);
+
+    // If the camera moved since the last frame, this frame's samples are
+    // traced on their own and the history is reprojected onto them after.
+    const bool camera_moved = has_rendered_ && camera_.matrix != rendered_camera_matrix_;
+    const bool reproject = !reset_history && camera_moved;
+
+    // Whatever changes the accumulation changes which pixels have converged,
+    // so the list is rebuilt from a full frame. Until its count is read back
+    // the list is traced as if every pixel were in it.
+    if (reset_history || camera_moved) {
+        has_active_pixels_ = false;
+    }
+    const bool adaptive_frame = adaptive_ && has_active_pixels_ && frames_since_mask_ < kAdaptiveInterval;
+    if (!has_active_pixels_) {
+        active_launch_size_ = width_ * height_;
+    }
+
+    // Adaptive frames only add to the pixels they trace, so they accumulate
+    // in place rather than copying every other pixel over to the other
+    // image.
+    const uint32_t back = texture_index;
+    const uint32_t front = adaptive_frame ? back : (texture_index + 1) % 2;
 
     // Set descriptors.
-    compute_buffer->bindAccelerationStructure(0,0, as_);
-    compute_buffer->bindStorageImage(1, 0, accum_textures_[texture_index]);
-    compute_buffer->bindStorageImage(1, 1, accum_textures_[(texture_index + 1) % 2]);
+    compute_buffer->bindAccelerationStructure(0,0, scene_.as);
+    compute_buffer->bindStorageImage(1, 0, accum_textures_[back]);
+    compute_buffer->bindStorageImage(1, 1, accum_textures_[front]);
     compute_buffer->bindStorageImage(1, 2, resolve_texture_);
-    compute_buffer->bindUniformBuffer(1, 3, random_seeds_[image_index]);
-    compute_buffer->bindUniformBuffer(2, 0, obj_descriptions_);
-    texture_index = (texture_index + 1) % 2;
+    compute_buffer->bindStorageImage(1, 3, position_textures_[front]);
+    compute_buffer->bindStorageImage(1, 4, normal_depth_texture_);
+    compute_buffer->bindStorageImage(1, 5, albedo_texture_);
+    compute_buffer->bindStorageImage(1, 6, moment_textures_[back]);
+    compute_buffer->bindStorageImage(1, 7, moment_textures_[front]);
+    compute_buffer->bindUniformBuffer(1, 8, active_pixels_);
+    compute_buffer->bindUniformBuffer(1, 9, guiding_records_[image_index]);
+    compute_buffer->bindUniformBuffer(2, 0, scene_.obj_descriptions);
+    compute_buffer->bindUniformBuffer(2, 1, scene_.triangle_normals);
+    compute_buffer->bindUniformBuffer(2, 2, scene_.materials);
+    compute_buffer->bindUniformBuffer(2, 3, guiding_buffers_.spatial_nodes);
+    compute_buffer->bindUniformBuffer(2, 4, guiding_buffers_.directional_nodes);
+    texture_index = front;
 
     // set push constants.
     compute_buffer->pushConstants(camera_.matrix);
@@ -428,10 +918,144 @@ gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
     compute_buffer->pushConstants(camera_.sensor_height, 72u);
     compute_buffer->pushConstants(width_, 76u);
     compute_buffer->pushConstants(height_, 80u);
-    compute_buffer->pushConstants(sample_, 84u);
-    sample_++;
+    // The raygen shader traces |samples_per_frame_| samples per pixel and
+    // numbers them up to the last of this frame's samples, which seeds
+    // their random numbers.
+    uint32_t total_samples = sample_ + samples_per_frame_ - 1;
+    compute_buffer->pushConstants(total_samples, 84u);
+    compute_buffer->pushConstants(samples_per_frame_, 88u);
+    compute_buffer->pushConstants(uint32_t(reproject ? 1 : 0), 92u);
+    compute_buffer->pushConstants(uint32_t(adaptive_frame ? 1 : 0), 96u);
+    compute_buffer->pushConstants(uint32_t(low_discrepancy_ ? 1 : 0), 100u);
+    compute_buffer->pushConstants(uint32_t(direct_light_resampling_ ? 1 : 0), 104u);
+
+    // Paths are recorded often enough to fill about the records buffer,
+    // until the tree is done training.
+    float record_probability = 0.f;
+    if (guiding_tree_->iteration() < kGuidingIterations) {
+        const float num_vertices = float(width_) * height_ * samples_per_frame_ * kGuidingVerticesPerPath;
+        record_probability = std::min(1.f, kGuidingRecordCapacity / num_vertices);
+        glm::uvec4 header(0, kGuidingRecordCapacity, 0, 0);
+        guiding_records_[image_index]->write(&header, 1);
+        has_guiding_records_[image_index] = true;
+        guiding_frames_++;
+    }
+    compute_buffer->pushConstants(record_probability, 108u);
+    sample_ += samples_per_frame_;
+
+    if (adaptive_frame) {
+        traced_pixels_ = std::min(active_launch_size_, width_ * height_);
+        if (traced_pixels_ > 0) {
+            compute_buffer->traceRays(traced_pixels_, 1);
+        }
+        frames_since_mask_++;
+    } else {
+        traced_pixels_ = width_ * height_;
+        compute_buffer->traceRays(width_, height_);
+    }
+
+    // Lights this frame's primary hits before the history is added, reusing
+    // the reservoirs of the surfaces the previous camera saw.
+    if (direct_light_resampling_ && traced_pixels_ > 0) {
+        const uint32_t flags = (has_rendered_ && !reset_history ? 1u : 0u) | (adaptive_frame ? 2u : 0u);
+        const glm::mat4& sphere_transform = sphere_.world_transform;
+        const glm::vec4 light(glm::vec3(sphere_transform[3]), glm::length(glm::vec3(sphere_transform[0])));
+
+        compute_buffer->setProgram(restir_->program());
+        compute_buffer->bindStorageImage(0, 0, accum_textures_[front]);
+        compute_buffer->bindStorageImage(0, 1, position_textures_[front]);
+        compute_buffer->bindStorageImage(0, 2, position_textures_[back]);
+        compute_buffer->bindStorageImage(0, 3, normal_depth_texture_);
+        compute_buffer->bindStorageImage(0, 4, albedo_texture_);
+        compute_buffer->bindUniformBuffer(0, 7, active_pixels_);
+        compute_buffer->bindStorageImage(0, 8, resolve_texture_);
+        compute_buffer->bindStorageImage(0, 9, moment_textures_[front]);
+        compute_buffer->bindAccelerationStructure(1, 0, scene_.as);
+        compute_buffer->pushConstants(glm::inverse(has_rendered_ ? rendered_camera_matrix_ : camera_.matrix));
+        compute_buffer->pushConstants(camera_.focal_length, 64u);
+        compute_buffer->pushConstants(camera_.sensor_width, 68u);
+        compute_buffer->pushConstants(camera_.sensor_height, 72u);
+        compute_buffer->pushConstants(width_, 76u);
+        compute_buffer->pushConstants(height_, 80u);
+        compute_buffer->pushConstants(total_samples, 84u);
+        compute_buffer->pushConstants(samples_per_frame_, 88u);
+        compute_buffer->pushConstants(flags, 92u);
+        compute_buffer->pushConstants(light, 96u);
+        compute_buffer->pushConstants(light_radiance_, 112u);
+        for (uint32_t stage = 0; stage < 2; stage++) {
+            compute_buffer->bindUniformBuffer(0, 5, reservoirs_[stage == 0 ? 1 : 0]);
+            compute_buffer->bindUniformBuffer(0, 6, reservoirs_[stage == 0 ? 0 : 1]);
+            compute_buffer->pushConstants(stage, 124u);
+            compute_buffer->dispatch((traced_pixels_ + 255) / 256, 1, 1);
+        }
+    }
+
+    if (reproject) {
+        compute_buffer->setProgram(reprojector_->program());
+        compute_buffer->bindStorageImage(0, 0, accum_textures_[back]);
+        compute_buffer->bindStorageImage(0, 1, accum_textures_[front]);
+        compute_buffer->bindStorageImage(0, 2, position_textures_[back]);
+        compute_buffer->bindStorageImage(0, 3, position_textures_[front]);
+        compute_buffer->bindStorageImage(0, 4, resolve_texture_);
+        compute_buffer->bindStorageImage(0, 5, moment_textures_[back]);
+        compute_buffer->bindStorageImage(0, 6, moment_textures_[front]);
+        compute_buffer->pushConstants(glm::inverse(rendered_camera_matrix_));
+        compute_buffer->pushConstants(camera_.focal_length, 64u);
+        compute_buffer->pushConstants(camera_.sensor_width, 68u);
+        compute_buffer->pushConstants(camera_.sensor_height, 72u);
+        compute_buffer->pushConstants(width_, 76u);
+        compute_buffer->pushConstants(height_, 80u);
+        compute_buffer->dispatch((width_ * height_ + 511) / 512, 1, 1);
+    }
+    rendered_camera_matrix_ = camera_.matrix;
+    has_rendered_ = true;
+
+    // Every full frame rebuilds the list from the accumulation it just
+    // finished.
+    if (adaptive_ && !adaptive_frame) {
+        uint32_t zero = 0;
+        active_pixel_counts_[image_index]->write(&zero, 1);
+        counted_generations_[image_index] = ++mask_generation_;
+
+        compute_buffer->setProgram(adaptive_mask_->program());
+        compute_buffer->bindStorageImage(0, 0, accum_textures_[front]);
+        compute_buffer->bindStorageImage(0, 1, moment_textures_[front]);
+        compute_buffer->bindUniformBuffer(0, 2, active_pixels_);
+        compute_buffer->bindUniformBuffer(0, 3, active_pixel_counts_[image_index]);
+        compute_buffer->pushConstants(width_);
+        compute_buffer->pushConstants(height_, 4u);
+        compute_buffer->pushConstants(kAdaptiveMinSamples, 8u);
+        compute_buffer->pushConstants(kAdaptiveMaxRelativeError, 12u);
+        for (uint32_t stage = 0; stage < 2; stage++) {
+            compute_buffer->pushConstants(stage, 16u);
+            compute_buffer->dispatch(stage == 0 ? 1 : (width_ * height_ + 255) / 256, 1, 1);
+        }
+        has_active_pixels_ = true;
+        frames_since_mask_ = 0;
+    }
+
+    // Measure the error whenever this frame's samples take the count past a
+    // power of two.
+    const uint32_t first_sample = total_samples - samples_per_frame_ + 1;
+    if (has_reference_ && camera_.matrix == reference_camera_matrix_ &&
+        std::bit_floor(total_samples) >= first_sample) {
+        uint32_t stage = 1;
+        compute_buffer->setProgram(error_meter_->program());
+        compute_buffer->bindStorageImage(0, 0, accum_textures_[front]);
+        compute_buffer->bindStorageImage(0, 1, reference_texture_);
+        compute_buffer->bindUniformBuffer(0, 2, squared_errors_[image_index]);
+        compute_buffer->pushConstants(width_);
+        compute_buffer->pushConstants(height_, 4u);
+        compute_buffer->pushConstants(stage, 8u);
+        compute_buffer->dispatch((width_ * height_ + kErrorWorkgroupSize - 1) / kErrorWorkgroupSize, 1, 1);
+        error_measurements_[image_index] = {total_samples, low_discrepancy_};
+    }
 
-    compute_buffer->traceRays(width_, height_);
+    // Replaces the plain average the passes above resolved to.
+    if (denoise_) {
+        denoiser_->record(compute_buffer, accum_textures_[front], moment_textures_[front], normal_depth_texture_,
+                          albedo_texture_, resolve_texture_);
+    }
 	
     resolve_texture_->transitionImageLayout(*compute_buffer.get(), vk::ImageLayout::eShaderReadOnlyOptimal); 
 
@@ -443,6 +1067,7 @@ gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
                                /*command_buffers*/&compute_buffer->vk(), 
                                /*signal_semaphore_count*/1U, 
                                /*signal_semaphores*/&compute_semaphores_[frame]);
+    // The harness holds the queue lock for the whole frame.
     logical_device->getQueue(gfx::Queue::Type::kCompute).submit(submit_info, vk::Fence());
 
 
@@ -456,10 +1081,33 @@ gfx::ComputeTexturePtr PathTracerKHR::renderFrame(
 
 PathTracerKHR::~PathTracerKHR() {
     auto logical_device = logical_device_.lock();
-    as_.reset();
+    if (pending_scene_.valid()) {
+        pending_scene_.wait();
+    }
+    scene_ = Scene();
+    retired_scene_ = Scene();
     shader_manager_.reset();
     accum_textures_[0].reset();
     accum_textures_[1].reset();
+    position_textures_[0].reset();
+    position_textures_[1].reset();
+    moment_textures_[0].reset();
+    moment_textures_[1].reset();
+    active_pixels_.reset();
+    active_pixel_counts_.clear();
+    adaptive_mask_.reset();
+    reference_texture_.reset();
+    squared_errors_.clear();
+    error_meter_.reset();
+    guiding_buffers_ = GuidingBuffers();
+    retired_guiding_buffers_.clear();
+    guiding_records_.clear();
+    reservoirs_[0].reset();
+    reservoirs_[1].reset();
+    restir_.reset();
+    normal_depth_texture_.reset();
+    albedo_texture_.reset();
+    denoiser_.reset();
     resolve_texture_.reset();
 
     for (auto& semaphore : compute_semaphores_) {
@@ -6,11 +6,16 @@
 #ifndef PATH_TRACER_KHR_HPP_
 #define PATH_TRACER_KHR_HPP_
 
+#include <future>
+#include <limits>
+#include <mutex>
 #include <string>
 #include "demo.hpp"
 #include "src/text_renderer.hpp"
 #include "src/shader_resource.hpp"
 #include "src/model.hpp"
+#include "src/atrous_denoiser.hpp"
+#include "src/sd_tree.hpp"
 #include <UsefulUtils/dispatch_queue.hpp>
 #include <VulkanWrappers/acceleration_structure.hpp>
 #include <VulkanWrappers/ray_tracing_shader_manager.hpp>
@@ -33,6 +38,18 @@ public:
     
     std::string name() override { return "PathTracerKHR"; }
 
+    std::string statusText() override;
+
+    // Keys, besides the harness's own A and N:
+    //   I, K, J, L, O, P  Move the camera.
+    //   Y, H              Move the sphere light up and down.
+    //   V, B              Move the second Lucy.
+    //   F                 Toggle the denoiser.
+    //   G                 Toggle adaptive sampling.
+    //   X                 Switch between Sobol and white noise sampling.
+    //   C                 Toggle direct light resampling.
+    //   U                 Toggle path guiding.
+    //   Z                 Capture a reference to measure the error against.
     void processEvent(display::InputEvent event) override;
 
 private:
@@ -44,13 +61,11 @@ private:
         float sensor_height;
     };
 
-    // Information of a obj model when referenced in a shader
+    // Information of a obj model when referenced in a shader. Offsets are
+    // in elements of the scene's arenas, read with scalar layout.
     struct ObjDesc  {
-        int      txtOffset;             // Texture index offset in the array of textures
-        uint64_t vertexAddress;         // Address of the Vertex buffer
-        uint64_t indexAddress;          // Address of the index buffer
-        uint64_t materialAddress;       // Address of the material buffer
-        uint64_t materialIndexAddress;  // Address of the triangle material index buffer
+        uint32_t triangle_offset;       // First record in the triangle normal arena
+        uint32_t material_index;        // Entry in the material arena
     };
 
     struct Material {
@@ -61,16 +76,24 @@ private:
         alignas(16) glm::vec4 emissive_color = glm::vec4(0.f);
     };
 
-    // Random
-    std::shared_ptr<christalz::ShaderResource> mwc64x_seeder_;
-    std::vector<gfx::ComputeBufferPtr> random_seeds_;
-
     // GPU data
     std::vector<gfx::CommandBufferPtr> compute_command_buffers_;
     std::vector<vk::Semaphore> compute_semaphores_;
 
     // Textures
     gfx::ComputeTexturePtr accum_textures_[2];
+
+    // World position of every pixel's primary hit, written alongside the
+    // accumulation image of the same index.
+    gfx::ComputeTexturePtr position_textures_[2];
+
+    // Sum of every pixel's squared sample luminance, alongside the
+    // accumulation image of the same index, for adaptive sampling.
+    gfx::ComputeTexturePtr moment_textures_[2];
+
+    // G-buffer of the primary hits that guides the denoiser.
+    gfx::ComputeTexturePtr normal_depth_texture_;
+    gfx::ComputeTexturePtr albedo_texture_;
     gfx::ComputeTexturePtr resolve_texture_;
     uint32_t texture_index = 0;
 
@@ -78,9 +101,6 @@ private:
     Camera camera_;
     std::vector<gfx::Geometry> geometries;
 
-    gfx::ComputeBufferPtr obj_descriptions_;
-    std::map<uint64_t, gfx::ComputeBufferPtr> materials_map_;
-    std::shared_ptr<gfx::AccelerationStructure> as_;
     std::shared_ptr<gfx::RayTracingShaderManager> shader_manager_;
     gfx::Geometry createGeometry(const gfx::LogicalDevicePtr& logical_device, 
                                 const std::vector<float>& positions, 
@@ -90,9 +110,169 @@ private:
     gfx::Geometry createBBox(const gfx::LogicalDevicePtr& logical_device,
                                 const Material& material);
 
+    // What the hit shaders read of a geometry, kept on the host so that
+    // every scene build can pack it into that scene's arenas.
+    // |triangle_normals| are generated when the geometry is created, see
+    // computeTriangleNormals().
+    struct ShadingData {
+        std::vector<glm::uvec4> triangle_normals;
+        Material material;
+    };
+
+    // Acceleration structure over a set of geometries, along with the
+    // per instance descriptions the shaders read through custom indices.
+    // The triangle normals and materials of every geometry in the scene are
+    // packed into one device local arena each, which the descriptions index
+    // into.
+    struct Scene {
+        std::shared_ptr<gfx::AccelerationStructure> as;
+        gfx::ComputeBufferPtr obj_descriptions;
+        gfx::ComputeBufferPtr triangle_normals;
+        gfx::ComputeBufferPtr materials;
+    };
+
+    // Builds a structure with an instance of every geometry in
+    // |scene_geometries|. If Lucy is among them, |lucy2| is added as a
+    // second instance of it.
+    Scene buildScene(const gfx::LogicalDevicePtr& logical_device,
+                     const std::vector<gfx::Geometry>& scene_geometries,
+                     const gfx::GeomInstance& sphere,
+                     const gfx::GeomInstance& lucy2);
+
+    // Loads the Lucy models and builds a new structure containing them on a
+    // separate thread, so the room renders in the meantime.
+    void streamLucy(const gfx::LogicalDevicePtr& logical_device);
+
+    // Switches rendering over to the streamed in structure once it is ready.
+    void swapInStreamedScene();
+
+    // Hands one of the transforms in |pending_transforms_| to the
+    // acceleration structure, so it is rebuilt at most once per frame.
+    void applyPendingTransforms();
+
+    // Picks up the number of unconverged pixels found by the last mask pass
+    // recorded into the command buffer for |image_index|.
+    void readActivePixelCount(uint32_t image_index);
+
+    // Logs the error measured by the command buffer for |image_index|, if
+    // it measured any.
+    void readImageError(uint32_t image_index);
+
+    // Hands the guiding records written by the command buffer for
+    // |image_index| to the tree, ends the training iteration if it has run
+    // its course and uploads the tree whenever it changed.
+    void updatePathGuiding(uint32_t image_index);
+
+    // Starts training the guiding tree over, once what it learned no longer
+    // matches the scene.
+    void resetPathGuiding();
+
     gfx::GeomInstance sphere_;
     gfx::GeomInstance lucy2_;
+
+    // Latest transform of every instance moved since the last frame, keyed
+    // by instance identifier.
+    std::map<uint64_t, glm::mat4> pending_transforms_;
+
+    // Scene being rendered.
+    Scene scene_;
+    std::map<uint64_t, ShadingData> shading_data_;
+
+    // Structure being built by streamLucy(), and the one it replaced, kept
+    // alive until no frame in flight can still be tracing it.
+    std::future<Scene> pending_scene_;
+    Scene retired_scene_;
+    uint32_t retired_frames_left_ = 0;
+    bool lucy_streamed_ = false;
+
     bool clear_image_ = false;
+
+    // Camera the last frame was rendered with, to reproject the history
+    // from when the camera moves.
+    std::shared_ptr<christalz::ShaderResource> reprojector_;
+    glm::mat4 rendered_camera_matrix_;
+    bool has_rendered_ = false;
+
+    // Filters the accumulated samples into the resolve image, so that
+    // previews at a few samples per pixel are usable.
+    std::shared_ptr<christalz::ATrousDenoiser> denoiser_;
+    bool denoise_ = true;
+
+    // Adaptive sampling. Every few frames the whole image is traced and
+    // adaptive_mask.comp lists the pixels that have not converged yet. The
+    // frames in between only trace the listed pixels.
+    std::shared_ptr<christalz::ShaderResource> adaptive_mask_;
+    gfx::ComputeBufferPtr active_pixels_;
+    bool adaptive_ = true;
+    bool has_active_pixels_ = false;
+    uint32_t frames_since_mask_ = 0;
+
+    // The list's length is counted into a host visible buffer per swap
+    // image, and read back once that image's command buffer is reused.
+    // Counts are only taken from the latest mask, see |mask_generation_|.
+    std::vector<gfx::ComputeBufferPtr> active_pixel_counts_;
+    std::vector<uint32_t> counted_generations_;
+    uint32_t mask_generation_ = 0;
+    uint32_t active_launch_size_ = 0;
+    uint32_t traced_pixels_ = 0;
+
+    // Draws the random numbers from an Owen scrambled Sobol sequence rather
+    // than white noise, see sampling/sampler.comp.
+    bool low_discrepancy_ = true;
+
+    // Sampler comparison. Z stores the image accumulated so far as the
+    // reference and starts over. From then on the RMSE against it is logged
+    // every time the sample count reaches a power of two, until the scene or
+    // the camera changes. Turn adaptive sampling off for the measurements
+    // to be at equal samples per pixel. Partial sums of the squared error
+    // are written to a host visible buffer per swap image and read back like
+    // the active pixel counts.
+    struct ErrorMeasurement {
+        uint32_t samples = 0;
+        bool low_discrepancy = false;
+    };
+    std::shared_ptr<christalz::ShaderResource> error_meter_;
+    gfx::ComputeTexturePtr reference_texture_;
+    std::vector<gfx::ComputeBufferPtr> squared_errors_;
+    std::vector<ErrorMeasurement> error_measurements_;
+    glm::mat4 reference_camera_matrix_;
+    bool capture_reference_ = false;
+    bool has_reference_ = false;
+
+    // Direct lighting of the primary hits by reservoir resampling, see
+    // restir.comp. |reservoirs_| holds every pixel's new candidates in the
+    // first buffer and the reservoirs it was shaded with in the second,
+    // which the next frame reuses.
+    std::shared_ptr<christalz::ShaderResource> restir_;
+    gfx::ComputeBufferPtr reservoirs_[2];
+    bool direct_light_resampling_ = true;
+
+    // Emission of the sphere, kept apart from |shading_data_| which the
+    // streaming thread adds to while frames render.
+    glm::vec3 light_radiance_ = glm::vec3(0.f);
+
+    // Online path guiding, see src/sd_tree.hpp. The tree is trained over
+    // kGuidingIterations iterations of doubling length from the records a
+    // random subset of the paths writes to a host visible buffer per swap
+    // image, read back once that image's command buffer is reused. Every
+    // iteration's tree is uploaded to host visible buffers, and the ones it
+    // replaced are kept alive until no frame in flight can still read them.
+    struct GuidingBuffers {
+        gfx::ComputeBufferPtr spatial_nodes;
+        gfx::ComputeBufferPtr directional_nodes;
+    };
+    std::unique_ptr<christalz::SDTree> guiding_tree_;
+    GuidingBuffers guiding_buffers_;
+    std::vector<std::pair<GuidingBuffers, uint32_t>> retired_guiding_buffers_;
+    std::vector<gfx::ComputeBufferPtr> guiding_records_;
+    std::vector<bool> has_guiding_records_;
+    uint32_t guiding_frames_ = 0;
+    bool guiding_dirty_ = true;
+    bool path_guiding_ = true;
+
+    // Bounds of the scene's geometry, which the guiding tree subdivides.
+    glm::vec3 bounds_min_ = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 bounds_max_ = glm::vec3(std::numeric_limits<float>::lowest());
 };
 
 #endif // PATH_TRACER_KHR_HPP_
@@ -0,0 +1,78 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#include "atrous_denoiser.hpp"
+#include <VulkanWrappers/image_utils.hpp>
+
+namespace christalz {
+
+namespace {
+
+const uint32_t kWorkgroupSize = 256;
+
+uint32_t numWorkgroups(uint32_t num_elements) {
+    return (num_elements + kWorkgroupSize - 1) / kWorkgroupSize;
+}
+
+} // anonymous namespace
+
+std::shared_ptr<ATrousDenoiser> ATrousDenoiser::create(const gfx::LogicalDevicePtr& device,
+                                                       const cxl::FileSystem& fs) {
+    auto denoiser = std::make_shared<ATrousDenoiser>();
+    denoiser->device_ = device;
+    denoiser->demodulate_ = ShaderResource::createCompute(device, fs, "denoise_demodulate");
+    denoiser->atrous_ = ShaderResource::createCompute(device, fs, "denoise_atrous");
+    CXL_DCHECK(denoiser->demodulate_ && denoiser->atrous_);
+    return denoiser;
+}
+
+void ATrousDenoiser::resize(uint32_t width, uint32_t height) {
+    auto device = device_.lock();
+    CXL_DCHECK(device);
+    width_ = width;
+    height_ = height;
+    for (uint32_t i = 0; i < 2; i++) {
+        illumination_[i] = gfx::ImageUtils::createAccumulationAttachment(device, width, height,
+                                                                         vk::ImageUsageFlagBits::eStorage,
+                                                                         vk::ImageLayout::eGeneral);
+        CXL_DCHECK(illumination_[i]);
+    }
+}
+
+void ATrousDenoiser::record(gfx::CommandBufferPtr command_buffer,
+                            const gfx::ComputeTexturePtr& accumulation,
+                            const gfx::ComputeTexturePtr& moments,
+                            const gfx::ComputeTexturePtr& normal_depth,
+                            const gfx::ComputeTexturePtr& albedo,
+                            const gfx::ComputeTexturePtr& output) const {
+    CXL_DCHECK(width_ > 0 && height_ > 0) << "resize() must be called first";
+    const uint32_t num_workgroups = numWorkgroups(width_ * height_);
+
+    command_buffer->setProgram(demodulate_->program());
+    command_buffer->bindStorageImage(0, 0, accumulation);
+    command_buffer->bindStorageImage(0, 1, normal_depth);
+    command_buffer->bindStorageImage(0, 2, albedo);
+    command_buffer->bindStorageImage(0, 3, illumination_[0]);
+    command_buffer->bindStorageImage(0, 4, moments);
+    command_buffer->pushConstants(glm::uvec2(width_, height_));
+    command_buffer->dispatch(num_workgroups, 1, 1);
+
+    // The last pass writes straight into |output| instead of the other
+    // illumination image.
+    for (uint32_t i = 0; i < kIterations; i++) {
+        const uint32_t final_pass = i + 1 == kIterations ? 1 : 0;
+        command_buffer->setProgram(atrous_->program());
+        command_buffer->bindStorageImage(0, 0, illumination_[i % 2]);
+        command_buffer->bindStorageImage(0, 1, illumination_[(i + 1) % 2]);
+        command_buffer->bindStorageImage(0, 2, normal_depth);
+        command_buffer->bindStorageImage(0, 3, albedo);
+        command_buffer->bindStorageImage(0, 4, output);
+        command_buffer->pushConstants(glm::uvec2(width_, height_));
+        command_buffer->pushConstants(1u << i, 8u);
+        command_buffer->pushConstants(final_pass, 12u);
+        command_buffer->dispatch(num_workgroups, 1, 1);
+    }
+}
+
+} // christalz
@@ -0,0 +1,70 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#ifndef INCLUDE_DEMO_ATROUS_DENOISER_HPP_
+#define INCLUDE_DEMO_ATROUS_DENOISER_HPP_
+
+#include "shader_resource.hpp"
+#include <VulkanWrappers/command_buffer.hpp>
+#include <VulkanWrappers/compute_texture.hpp>
+
+namespace christalz {
+
+// Edge aware à-trous wavelet denoiser, after Dammertz et al., "Edge-Avoiding
+// À-Trous Wavelet Transform for fast Global Illumination Filtering" (HPG
+// 2010), with the variance guided luminance weights of Schied et al.'s
+// SVGF (HPG 2017). It filters an accumulation image (summed radiance in
+// rgb, sample count in alpha) into a display image, guided by a G-buffer
+// of the primary hits:
+//
+//   1. Divide the albedo out of the mean radiance, so that texture and
+//      color detail isn't blurred along with the noise, and estimate the
+//      variance of every pixel's mean luminance from its moments, or from
+//      its neighborhood while it has only a few samples.
+//   2. Run |kIterations| 5x5 à-trous passes with doubling step sizes. Taps
+//      are weighted down across normal and depth edges and across
+//      luminance differences that the variance can't explain, and the
+//      variance is filtered along with the color.
+//   3. Multiply the albedo back in and write the display image.
+//
+// The whole filter is recorded into the caller's compute command buffer.
+class ATrousDenoiser {
+public:
+
+    static std::shared_ptr<ATrousDenoiser> create(const gfx::LogicalDevicePtr& device,
+                                                  const cxl::FileSystem& fs);
+
+    // (Re)allocates the intermediate images for |width| x |height| inputs.
+    void resize(uint32_t width, uint32_t height);
+
+    // Records filtering |accumulation| into |output| (rgba8). |normal_depth|
+    // holds the world space normal of every pixel's primary hit in xyz and
+    // its distance in w, zero for pixels that hit nothing. |albedo| holds
+    // the diffuse color of the primary hit. |moments| holds the sum of the
+    // squared luminance of the accumulated samples in x.
+    void record(gfx::CommandBufferPtr command_buffer,
+                const gfx::ComputeTexturePtr& accumulation,
+                const gfx::ComputeTexturePtr& moments,
+                const gfx::ComputeTexturePtr& normal_depth,
+                const gfx::ComputeTexturePtr& albedo,
+                const gfx::ComputeTexturePtr& output) const;
+
+private:
+
+    static const uint32_t kIterations = 5;
+
+    gfx::LogicalDeviceWeakPtr device_;
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+    std::shared_ptr<ShaderResource> demodulate_;
+    std::shared_ptr<ShaderResource> atrous_;
+
+    // Demodulated radiance in rgb and its variance in alpha, ping-ponged
+    // between the passes.
+    gfx::ComputeTexturePtr illumination_[2];
+};
+
+} // christalz
+
+#endif // INCLUDE_DEMO_ATROUS_DENOISER_HPP_
@@ -0,0 +1,91 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#include "buffer_pool.hpp"
+
+namespace christalz {
+
+namespace {
+
+// Largest ratio between the bucket a request is served from and the bucket
+// it rounds up to.
+const vk::DeviceSize kMaxOversize = 2;
+
+vk::DeviceSize bucketSize(vk::DeviceSize size) {
+    vk::DeviceSize bucket = 256;
+    while (bucket < size) {
+        bucket <<= 1;
+    }
+    return bucket;
+}
+
+} // anonymous namespace
+
+BufferPool::BufferPool(const gfx::LogicalDevicePtr& device, Memory memory)
+: device_(device)
+, memory_(memory) {}
+
+BufferPool::~BufferPool() {
+    CXL_DCHECK(in_use_.empty()) << in_use_.size() << " pooled buffers still in use";
+}
+
+gfx::ComputeBufferPtr BufferPool::acquire(vk::DeviceSize size) {
+    vk::DeviceSize bucket = bucketSize(size);
+
+    // Take the smallest available bucket that fits, as long as it doesn't
+    // waste more than the next size up.
+    gfx::ComputeBufferPtr buffer;
+    auto iter = free_.lower_bound(bucket);
+    if (iter != free_.end() && iter->first <= kMaxOversize * bucket) {
+        bucket = iter->first;
+        buffer = std::move(iter->second);
+        free_.erase(iter);
+    } else {
+        buffer = allocate(bucket);
+        allocated_bytes_ += bucket;
+    }
+
+    CXL_DCHECK(buffer);
+    in_use_[buffer.get()] = bucket;
+    return buffer;
+}
+
+void BufferPool::release(gfx::ComputeBufferPtr buffer) {
+    if (!buffer) {
+        return;
+    }
+    CXL_DCHECK(in_use_.count(buffer.get())) << "Buffer did not come from this pool";
+    retired_.push_back(std::move(buffer));
+}
+
+void BufferPool::reclaim() {
+    for (auto& buffer : retired_) {
+        auto iter = in_use_.find(buffer.get());
+        free_.emplace(iter->second, std::move(buffer));
+        in_use_.erase(iter);
+    }
+    retired_.clear();
+}
+
+void BufferPool::trim() {
+    for (const auto& entry : free_) {
+        allocated_bytes_ -= entry.first;
+    }
+    free_.clear();
+}
+
+gfx::ComputeBufferPtr BufferPool::allocate(vk::DeviceSize size) {
+    auto device = device_.lock();
+    CXL_DCHECK(device);
+    switch (memory_) {
+        case Memory::kDeviceLocal:
+            return gfx::ComputeBuffer::createStorageBuffer(device, size);
+        case Memory::kHostVisible:
+            return gfx::ComputeBuffer::createHostAccessableBuffer(device, size,
+                                                                  vk::BufferUsageFlagBits::eStorageBuffer);
+    }
+    return nullptr;
+}
+
+} // christalz
@@ -0,0 +1,72 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#ifndef INCLUDE_DEMO_BUFFER_POOL_HPP_
+#define INCLUDE_DEMO_BUFFER_POOL_HPP_
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <VulkanWrappers/compute_buffer.hpp>
+
+namespace christalz {
+
+// Recycles storage buffers across swapchain resizes. Requests are rounded up
+// to a power of two and served from the smallest available bucket of that
+// size or the next one up, so a resize that shrinks or stays within the same
+// buckets reuses the previous buffers rather than allocating new ones.
+//
+// Buffers handed back with release() may still be in use by the GPU, so they
+// only become available again once the owner calls reclaim() with the device
+// idle. Available buffers stay allocated until trim() is called.
+class BufferPool {
+public:
+
+    enum class Memory {
+        kDeviceLocal,
+        kHostVisible,
+    };
+
+    BufferPool(const gfx::LogicalDevicePtr& device, Memory memory);
+    ~BufferPool();
+
+    // Returns a buffer with room for at least |size| bytes. Its contents are
+    // undefined.
+    gfx::ComputeBufferPtr acquire(vk::DeviceSize size);
+
+    // Returns |buffer|, which must have come from acquire(), to the pool.
+    void release(gfx::ComputeBufferPtr buffer);
+
+    // Makes every released buffer available to acquire() again. The device
+    // must be idle.
+    void reclaim();
+
+    // Frees every buffer that is available but not handed out.
+    void trim();
+
+    // Bytes held by the pool, both handed out and waiting to be reused.
+    vk::DeviceSize allocatedBytes() const { return allocated_bytes_; }
+
+private:
+
+    gfx::ComputeBufferPtr allocate(vk::DeviceSize size);
+
+    gfx::LogicalDeviceWeakPtr device_;
+    Memory memory_;
+
+    // Available buffers, keyed by bucket size.
+    std::multimap<vk::DeviceSize, gfx::ComputeBufferPtr> free_;
+
+    // Released since the last reclaim(), possibly still used by the GPU.
+    std::vector<gfx::ComputeBufferPtr> retired_;
+
+    // Bucket size of every buffer currently handed out.
+    std::unordered_map<const gfx::ComputeBuffer*, vk::DeviceSize> in_use_;
+
+    vk::DeviceSize allocated_bytes_ = 0;
+};
+
+} // christalz
+
+#endif // INCLUDE_DEMO_BUFFER_POOL_HPP_
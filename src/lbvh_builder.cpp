@@ -0,0 +1,145 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#include "lbvh_builder.hpp"
+#include <limits>
+
+namespace christalz {
+
+namespace {
+
+// Workgroup size of every build kernel except the scan, which is also the
+// number of keys each radix sort workgroup handles.
+const uint32_t kWorkgroupSize = 256;
+const uint32_t kRadixBits = 8;
+const uint32_t kRadix = 1 << kRadixBits;
+
+uint32_t numWorkgroups(uint32_t num_elements) {
+    return (num_elements + kWorkgroupSize - 1) / kWorkgroupSize;
+}
+
+} // anonymous namespace
+
+std::shared_ptr<LBVHBuilder> LBVHBuilder::create(const gfx::LogicalDevicePtr& device,
+                                                 const cxl::FileSystem& fs) {
+    auto builder = std::make_shared<LBVHBuilder>();
+    builder->device_ = device;
+
+    builder->bounds_ = ShaderResource::createCompute(device, fs, "bvh_bounds");
+    builder->morton_ = ShaderResource::createCompute(device, fs, "bvh_morton");
+    builder->radix_histogram_ = ShaderResource::createCompute(device, fs, "radix_histogram");
+    builder->radix_scan_ = ShaderResource::createCompute(device, fs, "radix_scan");
+    builder->radix_scatter_ = ShaderResource::createCompute(device, fs, "radix_scatter");
+    builder->hierarchy_ = ShaderResource::createCompute(device, fs, "bvh_hierarchy");
+    builder->refit_ = ShaderResource::createCompute(device, fs, "bvh_refit");
+
+    CXL_DCHECK(builder->bounds_ && builder->morton_ && builder->radix_histogram_ && builder->radix_scan_ &&
+               builder->radix_scatter_ && builder->hierarchy_ && builder->refit_);
+    return builder;
+}
+
+std::shared_ptr<LBVHBuilder::BVH> LBVHBuilder::createBVH(uint32_t num_triangles) const {
+    CXL_DCHECK(num_triangles > 0);
+    // Keeps the tie-breaking indices to 31 bits, see kMaxDepth.
+    CXL_DCHECK(num_triangles <= uint32_t(std::numeric_limits<int32_t>::max()));
+    auto device = device_.lock();
+    CXL_DCHECK(device);
+
+    auto bvh = std::make_shared<BVH>();
+    bvh->num_triangles = num_triangles;
+    bvh->nodes = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(Node) * (2 * num_triangles - 1));
+    bvh->bounds = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(uint32_t) * 6);
+    for (uint32_t i = 0; i < 2; i++) {
+        bvh->keys[i] = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(uint32_t) * num_triangles);
+        bvh->values[i] = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(uint32_t) * num_triangles);
+    }
+    bvh->histograms = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(uint32_t) * kRadix *
+                                                                      numWorkgroups(num_triangles));
+    bvh->refit_flags = gfx::ComputeBuffer::createStorageBuffer(device, sizeof(uint32_t) * num_triangles);
+    return bvh;
+}
+
+void LBVHBuilder::recordBuild(gfx::CommandBufferPtr command_buffer,
+                              const gfx::ComputeBufferPtr& triangles,
+                              BVH* bvh) const {
+    CXL_DCHECK(bvh);
+    const uint32_t num_triangles = bvh->num_triangles;
+    const uint32_t num_blocks = numWorkgroups(num_triangles);
+
+    // Centroid bounds.
+    uint32_t initialize = 1;
+    command_buffer->setProgram(bounds_->program());
+    command_buffer->bindUniformBuffer(0, 0, triangles);
+    command_buffer->bindUniformBuffer(0, 1, bvh->bounds);
+    command_buffer->pushConstants(num_triangles);
+    command_buffer->pushConstants(initialize, sizeof(uint32_t));
+    command_buffer->dispatch(1, 1, 1);
+    initialize = 0;
+    command_buffer->pushConstants(initialize, sizeof(uint32_t));
+    command_buffer->dispatch(num_blocks, 1, 1);
+
+    // Morton codes.
+    command_buffer->setProgram(morton_->program());
+    command_buffer->bindUniformBuffer(0, 0, triangles);
+    command_buffer->bindUniformBuffer(0, 1, bvh->bounds);
+    command_buffer->bindUniformBuffer(0, 2, bvh->keys[0]);
+    command_buffer->bindUniformBuffer(0, 3, bvh->values[0]);
+    command_buffer->pushConstants(num_triangles);
+    command_buffer->dispatch(num_blocks, 1, 1);
+
+    // Radix sort. The keys ping pong between the two buffers and, with an
+    // even number of passes, end up back in the first one.
+    uint32_t num_entries = kRadix * num_blocks;
+    for (uint32_t pass = 0, shift = 0; shift < 32; pass++, shift += kRadixBits) {
+        const uint32_t src = pass % 2;
+        const uint32_t dst = 1 - src;
+
+        command_buffer->setProgram(radix_histogram_->program());
+        command_buffer->bindUniformBuffer(0, 0, bvh->keys[src]);
+        command_buffer->bindUniformBuffer(0, 2, bvh->histograms);
+        command_buffer->pushConstants(num_triangles);
+        command_buffer->pushConstants(shift, sizeof(uint32_t));
+        command_buffer->dispatch(num_blocks, 1, 1);
+
+        command_buffer->setProgram(radix_scan_->program());
+        command_buffer->bindUniformBuffer(0, 2, bvh->histograms);
+        command_buffer->pushConstants(num_entries);
+        command_buffer->dispatch(1, 1, 1);
+
+        command_buffer->setProgram(radix_scatter_->program());
+        command_buffer->bindUniformBuffer(0, 0, bvh->keys[src]);
+        command_buffer->bindUniformBuffer(0, 1, bvh->values[src]);
+        command_buffer->bindUniformBuffer(0, 2, bvh->histograms);
+        command_buffer->bindUniformBuffer(0, 3, bvh->keys[dst]);
+        command_buffer->bindUniformBuffer(0, 4, bvh->values[dst]);
+        command_buffer->pushConstants(num_triangles);
+        command_buffer->pushConstants(shift, sizeof(uint32_t));
+        command_buffer->dispatch(num_blocks, 1, 1);
+    }
+
+    // Topology.
+    command_buffer->setProgram(hierarchy_->program());
+    command_buffer->bindUniformBuffer(0, 0, bvh->keys[0]);
+    command_buffer->bindUniformBuffer(0, 1, bvh->values[0]);
+    command_buffer->bindUniformBuffer(0, 2, bvh->nodes);
+    command_buffer->bindUniformBuffer(0, 3, bvh->refit_flags);
+    command_buffer->pushConstants(num_triangles);
+    command_buffer->dispatch(num_blocks, 1, 1);
+
+    recordRefit(command_buffer, triangles, bvh);
+}
+
+void LBVHBuilder::recordRefit(gfx::CommandBufferPtr command_buffer,
+                              const gfx::ComputeBufferPtr& triangles,
+                              BVH* bvh) const {
+    CXL_DCHECK(bvh);
+    command_buffer->setProgram(refit_->program());
+    command_buffer->bindUniformBuffer(0, 0, triangles);
+    command_buffer->bindUniformBuffer(0, 2, bvh->nodes);
+    command_buffer->bindUniformBuffer(0, 3, bvh->refit_flags);
+    command_buffer->pushConstants(bvh->num_triangles);
+    command_buffer->dispatch(numWorkgroups(bvh->num_triangles), 1, 1);
+}
+
+} // christalz
@@ -0,0 +1,91 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#ifndef INCLUDE_DEMO_LBVH_BUILDER_HPP_
+#define INCLUDE_DEMO_LBVH_BUILDER_HPP_
+
+#include "shader_resource.hpp"
+#include <VulkanWrappers/command_buffer.hpp>
+#include <VulkanWrappers/compute_buffer.hpp>
+
+namespace christalz {
+
+// Builds linear BVHs over buffers of triangle records (see TriangleRecord in
+// types/shape.comp) entirely on the GPU, so that meshes whose triangles
+// change every frame can be rebuilt every frame. A build is a handful of
+// compute dispatches that get recorded into the caller's command buffer:
+//
+//   1. Reduce the bounds of the triangle centroids.
+//   2. Compute a Morton code for every centroid.
+//   3. Radix sort the triangles by their codes, 8 bits per pass.
+//   4. Emit the hierarchy from the sorted codes (Karras 2012).
+//   5. Refit the node bounds bottom up.
+//
+// If only the triangle positions changed, refitting the existing hierarchy
+// is enough and much cheaper, at the cost of a gradually worse tree.
+class LBVHBuilder {
+public:
+
+    // GPU buffers of a single BVH over |num_triangles| triangles. |nodes|
+    // holds BVHNodes (see types/bvh.comp), the rest is scratch space for
+    // the build that is kept around so rebuilds don't allocate.
+    struct BVH {
+        uint32_t num_triangles;
+        gfx::ComputeBufferPtr nodes;
+        gfx::ComputeBufferPtr bounds;
+        gfx::ComputeBufferPtr keys[2];
+        gfx::ComputeBufferPtr values[2];
+        gfx::ComputeBufferPtr histograms;
+        gfx::ComputeBufferPtr refit_flags;
+    };
+
+    // Mirrors BVHNode in types/bvh.comp.
+    struct Node {
+        alignas(16) float bbox_min[4];
+        alignas(16) float bbox_max[4];
+        alignas(4) int32_t left;
+        alignas(4) int32_t right;
+        alignas(4) int32_t parent;
+        alignas(4) int32_t primitive;
+    };
+
+    // Upper bound on the number of internal nodes along any root to leaf
+    // path. Each internal node on a path covers a strictly longer common
+    // prefix of the sorted keys than its parent. Distinct 30 bit Morton codes
+    // allow at most 30 such prefixes, and the triangle indices that break
+    // ties between equal codes allow at most 31 more. Traversal stacks are
+    // sized from this (see intersect_bvh.comp).
+    static constexpr uint32_t kMaxDepth = 61;
+
+    static std::shared_ptr<LBVHBuilder> create(const gfx::LogicalDevicePtr& device,
+                                               const cxl::FileSystem& fs);
+
+    std::shared_ptr<BVH> createBVH(uint32_t num_triangles) const;
+
+    // Records a full build of |bvh| over the records in |triangles|.
+    void recordBuild(gfx::CommandBufferPtr command_buffer,
+                     const gfx::ComputeBufferPtr& triangles,
+                     BVH* bvh) const;
+
+    // Records a refit of the bounds of an existing |bvh|, keeping its
+    // hierarchy.
+    void recordRefit(gfx::CommandBufferPtr command_buffer,
+                     const gfx::ComputeBufferPtr& triangles,
+                     BVH* bvh) const;
+
+private:
+
+    gfx::LogicalDeviceWeakPtr device_;
+    std::shared_ptr<ShaderResource> bounds_;
+    std::shared_ptr<ShaderResource> morton_;
+    std::shared_ptr<ShaderResource> radix_histogram_;
+    std::shared_ptr<ShaderResource> radix_scan_;
+    std::shared_ptr<ShaderResource> radix_scatter_;
+    std::shared_ptr<ShaderResource> hierarchy_;
+    std::shared_ptr<ShaderResource> refit_;
+};
+
+} // christalz
+
+#endif // INCLUDE_DEMO_LBVH_BUILDER_HPP_
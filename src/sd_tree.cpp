@@ -0,0 +1,203 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#include "sd_tree.hpp"
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+
+namespace christalz {
+
+namespace {
+
+// Maps a direction to the unit square by the cosine of its angle to z and
+// its angle around z, which preserves areas. Must match
+// directionToSquare in sampling/path_guiding.comp.
+glm::vec2 directionToSquare(glm::vec3 direction) {
+    float cos_theta = glm::clamp(direction.z, -1.f, 1.f);
+    float phi = std::atan2(direction.y, direction.x);
+    if (phi < 0.f) {
+        phi += 2.f * glm::pi<float>();
+    }
+    return glm::clamp(glm::vec2((cos_theta + 1.f) * 0.5f, phi / (2.f * glm::pi<float>())),
+                      glm::vec2(0.f), glm::vec2(0.99999994f));
+}
+
+float sum(glm::vec4 energies) {
+    return energies.x + energies.y + energies.z + energies.w;
+}
+
+} // anonymous namespace
+
+SDTree::SDTree(glm::vec3 bounds_min, glm::vec3 bounds_max)
+: bounds_min_(bounds_min)
+, bounds_max_(bounds_max) {
+    reset();
+}
+
+void SDTree::reset() {
+    nodes_.assign(1, Node());
+    leaves_.assign(1, Leaf());
+    leaves_[0].sampling.resize(1);
+    leaves_[0].building.resize(1);
+    iteration_ = 0;
+}
+
+void SDTree::record(glm::vec3 position, glm::vec3 direction, float radiance) {
+    if (!std::isfinite(radiance) || radiance <= 0.f) {
+        return;
+    }
+
+    // Find the leaf the position falls in.
+    glm::vec3 p = glm::clamp((position - bounds_min_) / (bounds_max_ - bounds_min_), glm::vec3(0.f), glm::vec3(1.f));
+    uint32_t node = 0;
+    while (nodes_[node].child != 0) {
+        uint32_t axis = nodes_[node].axis;
+        uint32_t side = p[axis] < 0.5f ? 0 : 1;
+        p[axis] = glm::clamp(p[axis] * 2.f - side, 0.f, 1.f);
+        node = nodes_[node].child + side;
+    }
+    Leaf& leaf = leaves_[nodes_[node].leaf];
+    leaf.num_records++;
+
+    // Add the radiance to every quadrant containing the direction, down to
+    // the quadtree's leaf.
+    glm::vec2 square = directionToSquare(direction);
+    uint32_t index = 0;
+    while (true) {
+        glm::uvec2 quadrant(square.x < 0.5f ? 0 : 1, square.y < 0.5f ? 0 : 1);
+        uint32_t child = quadrant.x + 2 * quadrant.y;
+        DirectionalNode& dnode = leaf.building[index];
+        dnode.energies[child] += radiance;
+        if (dnode.children[child] == 0) {
+            break;
+        }
+        square = square * 2.f - glm::vec2(quadrant);
+        index = dnode.children[child];
+    }
+}
+
+SDTree::DTree SDTree::subdivide(const DTree& tree) {
+    const float total = sum(tree[0].energies);
+
+    // Every entry is a node of the new tree along with its quadrants'
+    // energies, and the node of |tree| that covers the same square, if
+    // |tree| subdivided that far.
+    struct Entry {
+        uint32_t node;
+        glm::vec4 energies;
+        uint32_t source;
+        bool has_source;
+        uint32_t depth;
+    };
+
+    DTree result(1);
+    std::vector<Entry> stack = {{0, tree[0].energies, 0, true, 1}};
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
+        if (total <= 0.f || entry.depth >= kMaxDirectionalDepth) {
+            continue;
+        }
+        for (uint32_t child = 0; child < 4; child++) {
+            if (entry.energies[child] <= kDirectionalThreshold * total) {
+                continue;
+            }
+            Entry next;
+            next.node = result.size();
+            next.depth = entry.depth + 1;
+            next.has_source = entry.has_source && tree[entry.source].children[child] != 0;
+            if (next.has_source) {
+                next.source = tree[entry.source].children[child];
+                next.energies = tree[next.source].energies;
+            } else {
+                // Quadrants |tree| didn't resolve are assumed to be lit
+                // evenly.
+                next.source = 0;
+                next.energies = glm::vec4(entry.energies[child] * 0.25f);
+            }
+            result[entry.node].children[child] = next.node;
+            result.emplace_back();
+            stack.push_back(next);
+        }
+    }
+    return result;
+}
+
+void SDTree::refine() {
+    iteration_++;
+
+    // Leaves that recorded a lot are split in half, each half taking a copy
+    // of what the leaf learned.
+    const float threshold = kSpatialThreshold * std::sqrt(std::exp2(float(iteration_ - 1)));
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    for (uint32_t i = 0; i < nodes_.size(); i++) {
+        if (nodes_[i].child == 0) {
+            stack.push_back({i, 0});
+        }
+    }
+    // A leaf is split at most kMaxSpatialDepth times per iteration.
+    while (!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        Leaf& leaf = leaves_[nodes_[node].leaf];
+        if (leaf.num_records <= threshold || depth >= kMaxSpatialDepth) {
+            continue;
+        }
+        leaf.num_records /= 2;
+        Leaf copy = leaf;
+
+        uint32_t child = nodes_.size();
+        Node first;
+        first.leaf = nodes_[node].leaf;
+        first.axis = (nodes_[node].axis + 1) % 3;
+        Node second = first;
+        second.leaf = leaves_.size();
+        leaves_.push_back(std::move(copy));
+
+        nodes_[node].child = child;
+        nodes_[node].leaf = 0;
+        nodes_.push_back(first);
+        nodes_.push_back(second);
+        stack.push_back({child, depth + 1});
+        stack.push_back({child + 1, depth + 1});
+    }
+
+    // What was recorded becomes what is sampled from.
+    for (auto& leaf : leaves_) {
+        leaf.sampling = std::move(leaf.building);
+        leaf.building = subdivide(leaf.sampling);
+        leaf.num_records = 0;
+    }
+}
+
+void SDTree::flatten(Header* header,
+                     std::vector<SpatialNode>* spatial_nodes,
+                     std::vector<DirectionalNode>* directional_nodes) const {
+    header->bounds_min = bounds_min_;
+    header->bounds_max = bounds_max_;
+    header->ready = iteration_ > 0 ? 1 : 0;
+
+    std::vector<uint32_t> roots;
+    directional_nodes->clear();
+    for (const auto& leaf : leaves_) {
+        const uint32_t root = directional_nodes->size();
+        roots.push_back(root);
+        for (DirectionalNode node : leaf.sampling) {
+            for (uint32_t child = 0; child < 4; child++) {
+                if (node.children[child] != 0) {
+                    node.children[child] += root;
+                }
+            }
+            directional_nodes->push_back(node);
+        }
+    }
+
+    spatial_nodes->resize(nodes_.size());
+    for (uint32_t i = 0; i < nodes_.size(); i++) {
+        (*spatial_nodes)[i].child = nodes_[i].child;
+        (*spatial_nodes)[i].data = nodes_[i].child != 0 ? nodes_[i].axis : roots[nodes_[i].leaf];
+    }
+}
+
+} // christalz
@@ -0,0 +1,118 @@
+// Copyright 2023 Sic Studios. All rights reserved.
+// Use of this source code is governed by our license that can be
+// found in the LICENSE file.
+
+#ifndef INCLUDE_DEMO_SD_TREE_HPP_
+#define INCLUDE_DEMO_SD_TREE_HPP_
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace christalz {
+
+// Spatial-directional tree for online path guiding, after Müller et al.,
+// "Practical Path Guiding for Efficient Light-Transport Simulation" (EGSR
+// 2017). A binary tree splits the scene's bounds into cells, halving along
+// x, y and z in turn. Every leaf holds a quadtree over the sphere of
+// directions, mapped to the unit square by cylindrical coordinates so that
+// areas are preserved, whose nodes store how much radiance arrived through
+// each of their quadrants.
+//
+// Training happens in iterations. Every leaf has a quadtree that paths
+// sample from, learned by the previous iteration, and one that records the
+// radiance found this iteration. refine() ends an iteration: leaves that
+// saw many records are split, the recorded quadtrees become the ones
+// sampled from, and fresh ones are laid out to resolve the directions that
+// brought the most light more finely.
+//
+// The tree lives on the host. flatten() writes out the sampled quadtrees in
+// the layout sampling/path_guiding.comp reads.
+class SDTree {
+public:
+
+    // Layouts shared with sampling/path_guiding.comp.
+    struct Header {
+        glm::vec3 bounds_min;
+        uint32_t ready = 0;
+        glm::vec3 bounds_max;
+        uint32_t unused = 0;
+    };
+
+    // Leaves have no |child| and the index of their quadtree's root in
+    // |data|. Inner nodes have their two children at |child| and
+    // |child| + 1 and the axis they split in |data|.
+    struct SpatialNode {
+        uint32_t child = 0;
+        uint32_t data = 0;
+    };
+
+    // Radiance through each quadrant, and the quadrants' nodes, with 0 for
+    // quadrants that aren't subdivided. Quadrant x + 2y covers the half of
+    // the square at x along the first coordinate and y along the second.
+    struct DirectionalNode {
+        glm::vec4 energies = glm::vec4(0.f);
+        glm::uvec4 children = glm::uvec4(0);
+    };
+
+    SDTree(glm::vec3 bounds_min, glm::vec3 bounds_max);
+
+    // Forgets everything learned, as if no iteration had been trained.
+    void reset();
+
+    // Records |radiance| arriving at |position| from |direction|, already
+    // divided by the pdf of the direction having been sampled.
+    void record(glm::vec3 position, glm::vec3 direction, float radiance);
+
+    // Ends the current training iteration, see above.
+    void refine();
+
+    // Iterations refined so far. The tree has nothing to sample from until
+    // the first is.
+    uint32_t iteration() const { return iteration_; }
+
+    void flatten(Header* header,
+                 std::vector<SpatialNode>* spatial_nodes,
+                 std::vector<DirectionalNode>* directional_nodes) const;
+
+private:
+
+    // A quadtree, rooted at its first node.
+    using DTree = std::vector<DirectionalNode>;
+
+    struct Leaf {
+        DTree sampling;
+        DTree building;
+        uint32_t num_records = 0;
+    };
+
+    struct Node {
+        uint32_t child = 0;
+        uint32_t axis = 0;
+        uint32_t leaf = 0;
+    };
+
+    // Leaves that recorded more than this many times the square root of
+    // the iteration's length are split.
+    static constexpr uint32_t kSpatialThreshold = 1000;
+
+    // Quadrants that brought more than this fraction of a quadtree's
+    // radiance are subdivided, up to kMaxDirectionalDepth levels.
+    static constexpr float kDirectionalThreshold = 0.01f;
+    static constexpr uint32_t kMaxDirectionalDepth = 10;
+    static constexpr uint32_t kMaxSpatialDepth = 24;
+
+    // Lays out a zeroed quadtree that subdivides where |tree| recorded the
+    // most radiance.
+    static DTree subdivide(const DTree& tree);
+
+    glm::vec3 bounds_min_;
+    glm::vec3 bounds_max_;
+    std::vector<Node> nodes_;
+    std::vector<Leaf> leaves_;
+    uint32_t iteration_ = 0;
+};
+
+} // christalz
+
+#endif // INCLUDE_DEMO_SD_TREE_HPP_
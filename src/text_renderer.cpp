@@ -16,6 +16,10 @@ const std::map<char, glm::vec2> kGlyphMap =
     // Ordered by (row, column)
     {' ', {0,0} },
     {'!', {0,1} },
+    {'%', {0,5} },
+    {'(', {0,8} },
+    {')', {0,9} },
+    {'/', {1,5} },
     // TODO
     {'0', {1,6}},
     {'1', {1,7}},
@@ -30,11 +34,18 @@ const std::map<char, glm::vec2> kGlyphMap =
     {':', {2,6}},
     // TODO
     {'a', {6,5}},
+    {'c', {6,7}},
     {'e', {6, 9}},
+    {'f', {7,0}},
+    {'i', {7,3}},
     {'l', {7,6}},
     {'m', {7,7}},
     {'p', {8, 0}},
+    {'r', {8,2}},
     {'s', {8,3}},
+    {'t', {8,4}},
+    {'v', {8,6}},
+    {'x', {8,8}},
 };
 
 const float kWidth = 10, kHeight = 10;
@@ -81,9 +92,13 @@ void TextRenderer::renderText(gfx::CommandBufferPtr cmd_buffer,
     cmd_buffer->setDefaultState(gfx::CommandBufferState::DefaultState::kTranslucent);
 
     for (int i = 0; i < text.size(); i++) {
-        auto glyph = text[i];
-        CXL_DCHECK(kGlyphMap.find(glyph) != kGlyphMap.end());
-        auto glyph_coords = kGlyphMap.at(glyph);
+        // Characters missing from the atlas are left blank rather than
+        // taking the whole frame down.
+        auto glyph = kGlyphMap.find(text[i]);
+        if (glyph == kGlyphMap.end()) {
+            continue;
+        }
+        auto glyph_coords = glyph->second;
 
         int curr_col = i % num_per_row;
         int curr_row = i / num_per_row;